@@ -36,6 +36,12 @@ int main(int argc, char **argv)
 
     log_error("This should print the timestamp!");
 
+    /* a hot loop only logs a few of these, and says how many it held back */
+    for (ii = 0; ii < 1000; ii++) {
+        log_io_warn_ratelimited("Retrying write (attempt %d)", ii);
+        log_io_info_sampled("Sampled message %d", ii);
+    }
+
 
 
     for (ii = 0; ii < 10; ii++) {
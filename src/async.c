@@ -0,0 +1,1355 @@
+/**
+ * Asynchronous logging.
+ *
+ * Logging threads claim a slot in a bounded ring and format their message
+ * into it. Each slot carries its own sequence number, which is how a slot
+ * is handed between producers and the writer without a lock: a producer
+ * claims a position by advancing 'head' with a compare-and-swap, fills the
+ * slot and then publishes it by bumping the slot's sequence number. The
+ * single writer thread consumes slots in order, writes them out, and hands
+ * them back to producers by bumping the sequence once more.
+ *
+ * The writer only flushes its outputs once it has caught up with the
+ * producers, so a burst of messages costs a handful of write() calls rather
+ * than one per message.
+ *
+ * When the queue is full, a producer acts according to the group's overflow
+ * policy: it waits for room (for at most a given time), drops its own
+ * message, or drops the oldest queued message by claiming it from the
+ * writer. The writer claims slots with a compare-and-swap on 'tail' for
+ * this reason. Dropped messages are counted, and the count is reported by
+ * the writer as a message of its own once it has caught up.
+ *
+ * Messages at or above the group's priority level go through a separate,
+ * smaller queue, which the writer always drains first so that an error is
+ * not stuck behind a backlog of debug messages. Every message carries its
+ * sequence number (see yolog_next_seq), and a priority message is never
+ * written ahead of a bulk message more than 'prio_window' numbers older than
+ * it, so readers can put the lines back in order by looking that far ahead.
+ *
+ * Alternatively the writer can put them back in order itself. It then keeps
+ * up to 'order_window' claimed slots in a heap ordered by sequence number,
+ * and writes the oldest once the heap is full, or all of them once there is
+ * nothing left to claim and no producer is still filling in a slot. The
+ * slots are only handed back to the producers once written.
+ *
+ * The bulk queue may be split into one shard per CPU, so that producers on
+ * different cores don't contend on the same ring. A producer uses the shard
+ * of the CPU it is running on (as told by sched_getcpu(), which reads it
+ * from the kernel's restartable sequence area where glibc has one); since
+ * each shard is itself safe for any number of producers, it does not matter
+ * if the thread moves to another CPU in the meantime. The writer takes the
+ * oldest published message across the shards. The queue size is split
+ * between the shards, so memory use grows with the number of CPUs and not
+ * of threads.
+ *
+ * The writer may also shed load before it comes to dropping messages: it
+ * samples the depth of the queue and how long messages waited in it, and
+ * while either is over its limit it raises the level of whichever context
+ * has been logging the most. The levels are lowered again, one step at a
+ * time, once the queue has drained.
+ */
+
+/* needed for vsnprintf and clock_gettime in strict C89 builds */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
+#endif /* __unix__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "yolog.h"
+
+#if defined(__unix__) && defined(__GNUC__)
+#define YOLOG_ASYNC_SUPPORTED
+#endif
+
+#ifdef YOLOG_ASYNC_SUPPORTED
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define async_barrier() __sync_synchronize()
+#define async_cas(p, o, n) __sync_bool_compare_and_swap(p, o, n)
+
+/* how long the writer sleeps when idle before re-checking the queue */
+#define ASYNC_IDLE_WAIT_MS 100
+
+/* how often dropped messages are reported while the queue stays busy */
+#define ASYNC_DROP_REPORT_MS 1000
+
+/* how often the writer decides whether to shed load */
+#define ASYNC_SHED_INTERVAL_MS 250
+
+/* the writer measures the lag of one in this many messages */
+#define ASYNC_SHED_TICK 64
+
+/* how often an ordering writer yields to a producer filling in a slot */
+#define ASYNC_ORDER_SPINS 64
+
+struct yolog_aslot_st {
+    volatile unsigned long seq;
+    yolog_context *ctx;
+    unsigned omask;
+    struct yolog_msginfo_st minfo;
+    size_t nbody;
+    char body[YOLOG_ASYNC_MSG_MAX];
+};
+
+struct yolog_aring_st {
+    struct yolog_aslot_st *slots;
+    unsigned long mask;
+
+    /* next position to be claimed by a producer */
+    volatile unsigned long head;
+
+    /* keep the producers' and writer's positions on separate lines */
+    char pad[64];
+
+    /* next position to be consumed by the writer */
+    volatile unsigned long tail;
+    char pad2[64];
+};
+
+/* a slot held back by an ordering writer */
+struct yolog_aheld_st {
+    struct yolog_aring_st *ring;
+    struct yolog_aslot_st *slot;
+    unsigned long pos;
+};
+
+struct yolog_async_st {
+    yolog_context_group *grp;
+
+    /* queues for messages below (one per shard) and at or above prio_level */
+    struct yolog_aring_st *bulk;
+    unsigned nbulk;
+    struct yolog_aring_st prio;
+    int prio_level;
+
+    /* how far ahead of a bulk message a priority message may be written */
+    unsigned long prio_window;
+
+    /* slots held back to be written in order, as a heap; writer only */
+    volatile unsigned order_window;
+    struct yolog_aheld_st *held;
+    unsigned nheld;
+
+    volatile int sleeping;
+    volatile int stopping;
+
+    /* as started, to tell whether a later start asks for something else */
+    unsigned nslots;
+    char backend[16];
+    int percpu;
+
+    /* YOLOG_OVERFLOW_*, and its parameters */
+    int overflow;
+    unsigned overflow_timeout;
+    int overflow_level;
+
+    /* messages dropped since the last report, and where they'd have gone */
+    volatile unsigned long dropped;
+    volatile unsigned drop_omask;
+    yolog_context * volatile drop_ctx;
+    unsigned long drop_reported;
+
+    /* limits on queue depth (percent) and lag (ms) for shedding load */
+    volatile unsigned shed_depth;
+    volatile unsigned shed_lag;
+
+    /* writer state for shedding: the worst lag seen, and when it decided */
+    unsigned long shed_maxlag;
+    unsigned long shed_sampled;
+    unsigned shed_tick;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thr;
+
+    /* batched writes to the outputs; only touched by the writer */
+    struct yolog_io_st *io;
+
+    struct yolog_async_st *next;
+};
+
+/* all running writers, so they can be drained at exit */
+static struct yolog_async_st *Yolog_Async_List;
+static pthread_mutex_t Yolog_Async_Mutex = PTHREAD_MUTEX_INITIALIZER;
+static int Yolog_Async_Atexit;
+
+static void
+async_wake(struct yolog_async_st *as)
+{
+    async_barrier();
+    if (!as->sleeping) {
+        return;
+    }
+    pthread_mutex_lock(&as->mutex);
+    pthread_cond_signal(&as->cond);
+    pthread_mutex_unlock(&as->mutex);
+}
+
+/**
+ * Returns the oldest slot of the ring if it is ready to be written
+ */
+static struct yolog_aslot_st *
+async_peek(struct yolog_aring_st *ring)
+{
+    unsigned long pos = ring->tail;
+    struct yolog_aslot_st *slot = ring->slots + (pos & ring->mask);
+
+    if (slot->seq != pos + 1) {
+        return NULL;
+    }
+    async_barrier();
+    return slot;
+}
+
+/**
+ * Returns the bulk shard whose oldest slot is the oldest message ready to be
+ * written, or NULL if there are none
+ */
+static struct yolog_aring_st *
+async_oldest(struct yolog_async_st *as, struct yolog_aslot_st **slotp)
+{
+    struct yolog_aring_st *ring = NULL;
+    struct yolog_aslot_st *slot;
+    unsigned ii;
+
+    *slotp = NULL;
+    for (ii = 0; ii < as->nbulk; ii++) {
+        slot = async_peek(as->bulk + ii);
+        if (slot && (!*slotp ||
+                (long)(slot->minfo.m_seq - (*slotp)->minfo.m_seq) < 0)) {
+            ring = as->bulk + ii;
+            *slotp = slot;
+        }
+    }
+    return ring;
+}
+
+/**
+ * Returns the bulk shard a producer should use
+ */
+static struct yolog_aring_st *
+async_shard(struct yolog_async_st *as)
+{
+#ifdef __linux__
+    int cpu;
+#endif
+
+    if (as->nbulk == 1) {
+        return as->bulk;
+    }
+
+#ifdef __linux__
+    cpu = sched_getcpu();
+    if (cpu >= 0) {
+        return as->bulk + (unsigned)cpu % as->nbulk;
+    }
+#endif
+    /* spread the threads out instead */
+    return as->bulk + yolog_thread_id() % as->nbulk;
+}
+
+/**
+ * Returns how full (in percent) the fullest bulk shard is, since that is
+ * where producers first run out of room
+ */
+static unsigned
+async_fill(struct yolog_async_st *as)
+{
+    unsigned long depth;
+    unsigned ii, pct, max = 0;
+
+    for (ii = 0; ii < as->nbulk; ii++) {
+        depth = as->bulk[ii].head - as->bulk[ii].tail;
+        pct = (unsigned)(depth * 100 / (as->bulk[ii].mask + 1));
+        if (pct > max) {
+            max = pct;
+        }
+    }
+    return max;
+}
+
+static void
+async_idle_wait(struct yolog_async_st *as)
+{
+    struct yolog_aslot_st *slot;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += ASYNC_IDLE_WAIT_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&as->mutex);
+    as->sleeping = 1;
+    async_barrier();
+
+    /* re-check now that producers can see we're sleeping */
+    if (!async_peek(&as->prio) && !async_oldest(as, &slot) && !as->stopping) {
+        pthread_cond_timedwait(&as->cond, &as->mutex, &ts);
+    }
+
+    as->sleeping = 0;
+    pthread_mutex_unlock(&as->mutex);
+}
+
+static unsigned long
+async_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+async_note_drop(struct yolog_async_st *as, yolog_context *ctx, unsigned omask)
+{
+    as->drop_ctx = ctx;
+    __sync_fetch_and_or(&as->drop_omask, omask);
+    __sync_fetch_and_add(&as->dropped, 1);
+}
+
+/**
+ * Writes a warning of the writer's own to the text outputs in omask, as
+ * though it was logged by 'ctx'
+ */
+static void
+async_notice(struct yolog_async_st *as,
+             yolog_context *ctx,
+             unsigned omask,
+             const char *func,
+             int line,
+             const char *body)
+{
+    struct yolog_msginfo_st minfo;
+
+    /* binary outputs can't take a rendered message */
+    omask = yolog_text_omask(ctx, omask);
+    if (!omask) {
+        return;
+    }
+
+    memset(&minfo, 0, sizeof(minfo));
+    minfo.m_seq = yolog_next_seq();
+    minfo.m_level = YOLOG_WARN;
+    minfo.m_file = __FILE__;
+    minfo.m_line = line;
+    minfo.m_func = func;
+    minfo.m_prefix = ctx->prefix && *ctx->prefix ? ctx->prefix : "-";
+    yolog_msginfo_stamp(&minfo);
+
+    yolog_emit(ctx, omask, &minfo, body, strlen(body), as->io);
+}
+
+/**
+ * Writes a message saying how many messages were dropped, to the outputs
+ * they would have gone to
+ */
+static void
+async_report_drops(struct yolog_async_st *as)
+{
+    unsigned long ndropped;
+    unsigned omask;
+    char body[96];
+
+    as->drop_reported = async_now_ms();
+    ndropped = __sync_fetch_and_and(&as->dropped, 0);
+    if (!ndropped) {
+        return;
+    }
+
+    /**
+     * The report goes through the last context which dropped; the
+     * per-subsystem file bit may have come from another context.
+     */
+    omask = __sync_fetch_and_and(&as->drop_omask, 0);
+    if (!as->drop_ctx->o_alt) {
+        omask &= ~(1 << YOLOG_OUTPUT_PFILE);
+    }
+    sprintf(body, "Yolog: %lu message(s) dropped, the queue was full",
+            ndropped);
+    async_notice(as, as->drop_ctx, omask, "async_report_drops", __LINE__,
+                 body);
+}
+
+static const char *
+async_level_name(int level)
+{
+#define X(n, i) \
+    if (level == i) { return #n; }
+    YOLOG_XLVL(X)
+#undef X
+    return "?";
+}
+
+/**
+ * Raises the level of the context which queued the most messages since the
+ * last sample, among those which can still be raised
+ */
+static void
+async_shed_raise(struct yolog_async_st *as, unsigned pct)
+{
+    yolog_context_group *grp = as->grp;
+    yolog_context *ctx, *noisiest = NULL;
+    int ii, cap = as->prio_level < YOLOG_ERROR ? as->prio_level : YOLOG_ERROR;
+    char body[160];
+
+    for (ii = 0; ii < grp->ncontexts; ii++) {
+        ctx = grp->contexts + ii;
+        if (ctx->level + 1 > cap || !ctx->nqueued) {
+            continue;
+        }
+        if (!noisiest || ctx->nqueued > noisiest->nqueued) {
+            noisiest = ctx;
+        }
+    }
+
+    if (!noisiest) {
+        return;
+    }
+
+    yolog_set_shed(noisiest, noisiest->level + 1);
+    sprintf(body, "Yolog: Shedding load (queue %u%% full, %lums behind), "
+            "dropping messages below %s",
+            pct, as->shed_maxlag, async_level_name(noisiest->shed));
+    async_notice(as, noisiest, noisiest->omasks[YOLOG_WARN],
+                 "async_shed_raise", __LINE__, body);
+}
+
+/**
+ * Lowers the level of each shed context by one step
+ */
+static void
+async_shed_restore(struct yolog_async_st *as)
+{
+    yolog_context_group *grp = as->grp;
+    int ii;
+    char body[128];
+
+    for (ii = 0; ii < grp->ncontexts; ii++) {
+        yolog_context *ctx = grp->contexts + ii;
+        int shed;
+
+        if (!ctx->shed) {
+            continue;
+        }
+
+        /* the outputs accept messages below 'shed' if they accept shed-1 */
+        shed = ctx->shed - 1;
+        if (shed > 0 && ctx->omasks[shed - 1]) {
+            yolog_set_shed(ctx, shed);
+            sprintf(body, "Yolog: Load is easing, dropping messages "
+                    "below %s", async_level_name(shed));
+        } else {
+            yolog_set_shed(ctx, 0);
+            sprintf(body, "Yolog: Load is back to normal, no longer "
+                    "dropping messages");
+        }
+        async_notice(as, ctx, ctx->omasks[YOLOG_WARN],
+                     "async_shed_restore", __LINE__, body);
+    }
+}
+
+/**
+ * Decides, every ASYNC_SHED_INTERVAL_MS, whether to shed load or restore
+ * it. Returns 1 if something was written.
+ */
+static int
+async_shed_check(struct yolog_async_st *as, unsigned long now)
+{
+    unsigned pct = async_fill(as);
+    unsigned limit = as->shed_depth, lag = as->shed_lag;
+    int ii, busy, calm, rv = 0;
+
+    if (now - as->shed_sampled < ASYNC_SHED_INTERVAL_MS) {
+        return 0;
+    }
+
+    busy = (limit && pct >= limit) || (lag && as->shed_maxlag >= lag);
+    calm = (!limit || pct < limit / 4) && (!lag || as->shed_maxlag < lag / 4);
+
+    if (busy) {
+        async_shed_raise(as, pct);
+        rv = 1;
+    } else if (calm) {
+        async_shed_restore(as);
+        rv = 1;
+    }
+
+    for (ii = 0; ii < as->grp->ncontexts; ii++) {
+        __sync_fetch_and_and(&as->grp->contexts[ii].nqueued, 0);
+    }
+    as->shed_maxlag = 0;
+    as->shed_sampled = now;
+    return rv;
+}
+
+/**
+ * Claims the oldest published slot, which is then either written out by the
+ * writer or dropped by a producer. Returns NULL if there isn't one, or
+ * somebody else got it first.
+ */
+static struct yolog_aslot_st *
+async_claim(struct yolog_aring_st *ring, unsigned long *pos)
+{
+    struct yolog_aslot_st *slot;
+
+    *pos = ring->tail;
+    slot = ring->slots + (*pos & ring->mask);
+    if (slot->seq != *pos + 1) {
+        return NULL;
+    }
+
+    async_barrier();
+    if (!async_cas(&ring->tail, *pos, *pos + 1)) {
+        return NULL;
+    }
+    return slot;
+}
+
+static void
+async_release(struct yolog_aring_st *ring,
+              struct yolog_aslot_st *slot,
+              unsigned long pos)
+{
+    async_barrier();
+    slot->seq = pos + ring->mask + 1;
+}
+
+/**
+ * Chooses the ring the writer takes its next message from, or returns NULL
+ * if all are empty
+ */
+static struct yolog_aring_st *
+async_pick(struct yolog_async_st *as)
+{
+    struct yolog_aslot_st *pslot = async_peek(&as->prio), *bslot;
+    struct yolog_aring_st *bulk = async_oldest(as, &bslot);
+
+    if (pslot && bslot) {
+        long ahead = (long)(pslot->minfo.m_seq - bslot->minfo.m_seq);
+        return ahead > (long)as->prio_window ? bulk : &as->prio;
+    }
+
+    if (pslot) {
+        return &as->prio;
+    }
+    return bulk;
+}
+
+/**
+ * Whether no slot of any ring is claimed, published or not
+ */
+static int
+async_empty(struct yolog_async_st *as)
+{
+    unsigned ii;
+
+    if (as->prio.head != as->prio.tail) {
+        return 0;
+    }
+    for (ii = 0; ii < as->nbulk; ii++) {
+        if (as->bulk[ii].head != as->bulk[ii].tail) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Writes out a claimed slot and hands it back to the producers
+ */
+static void
+async_write(struct yolog_async_st *as,
+            struct yolog_aring_st *ring,
+            struct yolog_aslot_st *slot,
+            unsigned long pos)
+{
+    yolog_tsc_resolve(&slot->minfo);
+
+    if ((as->shed_depth || as->shed_lag) &&
+            ++as->shed_tick % ASYNC_SHED_TICK == 0) {
+        unsigned long now = async_now_ms(), lag;
+        lag = now - (slot->minfo.m_mono_sec * 1000 +
+                     slot->minfo.m_mono_nsec / 1000000);
+        if (lag > as->shed_maxlag && (long)lag > 0) {
+            as->shed_maxlag = lag;
+        }
+        async_shed_check(as, now);
+    }
+
+    yolog_emit(slot->ctx, slot->omask, &slot->minfo,
+               slot->body, slot->nbody, as->io);
+    async_release(ring, slot, pos);
+}
+
+#define async_held_before(as, a, b) \
+    ((long)((as)->held[a].slot->minfo.m_seq - \
+            (as)->held[b].slot->minfo.m_seq) < 0)
+
+static void
+async_held_swap(struct yolog_async_st *as, unsigned a, unsigned b)
+{
+    struct yolog_aheld_st tmp = as->held[a];
+    as->held[a] = as->held[b];
+    as->held[b] = tmp;
+}
+
+/**
+ * Adds a claimed slot to the ordering heap
+ */
+static void
+async_hold(struct yolog_async_st *as,
+           struct yolog_aring_st *ring,
+           struct yolog_aslot_st *slot,
+           unsigned long pos)
+{
+    unsigned ii = as->nheld++;
+
+    as->held[ii].ring = ring;
+    as->held[ii].slot = slot;
+    as->held[ii].pos = pos;
+
+    while (ii && async_held_before(as, ii, (ii - 1) / 2)) {
+        async_held_swap(as, ii, (ii - 1) / 2);
+        ii = (ii - 1) / 2;
+    }
+}
+
+/**
+ * Writes out the oldest held slot
+ */
+static void
+async_write_held(struct yolog_async_st *as)
+{
+    struct yolog_aheld_st top = as->held[0];
+    unsigned ii = 0;
+
+    as->held[0] = as->held[--as->nheld];
+    for (;;) {
+        unsigned child = ii * 2 + 1, min = ii;
+
+        if (child < as->nheld && async_held_before(as, child, min)) {
+            min = child;
+        }
+        if (child + 1 < as->nheld && async_held_before(as, child + 1, min)) {
+            min = child + 1;
+        }
+        if (min == ii) {
+            break;
+        }
+        async_held_swap(as, ii, min);
+        ii = min;
+    }
+
+    async_write(as, top.ring, top.slot, top.pos);
+}
+
+static void *
+async_writer(void *arg)
+{
+    struct yolog_async_st *as = arg;
+    int dirty = 0, spins = 0;
+
+    for (;;) {
+        struct yolog_aring_st *ring;
+        struct yolog_aslot_st *slot;
+        unsigned long pos;
+
+        if (yolog_dedup_report_due(as->grp, as->io)) {
+            dirty = 1;
+        }
+
+        if (as->dropped &&
+                async_now_ms() - as->drop_reported >= ASYNC_DROP_REPORT_MS) {
+            async_report_drops(as);
+            dirty = 1;
+        }
+
+        ring = async_pick(as);
+        slot = ring ? async_claim(ring, &pos) : NULL;
+        if (!slot && ring) {
+            /* a producer dropped the slot we were after */
+            continue;
+        }
+
+        if (slot && (as->nheld || as->order_window)) {
+            async_hold(as, ring, slot, pos);
+            while (as->nheld && as->nheld >= as->order_window) {
+                async_write_held(as);
+                dirty = 1;
+            }
+            continue;
+        }
+
+        if (!slot && as->nheld) {
+            /**
+             * Nothing more to claim. Give a producer which is still filling
+             * in a slot (possibly an older message) a chance to finish.
+             */
+            if (!async_empty(as) && spins++ < ASYNC_ORDER_SPINS) {
+                sched_yield();
+                continue;
+            }
+            spins = 0;
+            while (as->nheld) {
+                async_write_held(as);
+            }
+            dirty = 1;
+            continue;
+        }
+
+        if (!slot) {
+            if ((as->shed_depth || as->shed_lag) &&
+                    async_shed_check(as, async_now_ms())) {
+                dirty = 1;
+            }
+
+            if (as->dropped) {
+                /* there's room again */
+                async_report_drops(as);
+                dirty = 1;
+            }
+
+            if (dirty) {
+                yolog_flush_outputs(as->grp);
+                yolog_io_flush(as->io);
+                dirty = 0;
+                continue;
+            }
+
+            /* don't leave a claimed but unpublished slot behind */
+            if (as->stopping && async_empty(as)) {
+                break;
+            }
+
+            async_idle_wait(as);
+            continue;
+        }
+
+        async_write(as, ring, slot, pos);
+        dirty = 1;
+    }
+
+    return NULL;
+}
+
+/**
+ * Called by a producer which found the queue full. Returns 0 to try again,
+ * or -1 if the message should be dropped.
+ */
+static int
+async_overflow(struct yolog_async_st *as,
+               struct yolog_aring_st *ring,
+               yolog_context *ctx,
+               unsigned omask,
+               int level,
+               unsigned long *deadline)
+{
+    struct yolog_aslot_st *slot;
+    unsigned long pos;
+
+    switch (as->overflow) {
+    case YOLOG_OVERFLOW_DROP_NEWEST:
+        async_note_drop(as, ctx, omask);
+        return -1;
+
+    case YOLOG_OVERFLOW_DROP_OLDEST:
+        if ( (slot = async_claim(ring, &pos))) {
+            async_note_drop(as, slot->ctx, slot->omask);
+            async_release(ring, slot, pos);
+        } else {
+            /* the oldest slot is still being filled in */
+            sched_yield();
+        }
+        return 0;
+
+    case YOLOG_OVERFLOW_DROP_BELOW:
+        if (level < as->overflow_level) {
+            async_note_drop(as, ctx, omask);
+            return -1;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    /* wait for the writer to catch up */
+    if (as->overflow_timeout) {
+        unsigned long now = async_now_ms();
+        if (!*deadline) {
+            *deadline = now + as->overflow_timeout;
+        } else if ((long)(now - *deadline) >= 0) {
+            async_note_drop(as, ctx, omask);
+            return -1;
+        }
+    }
+
+    async_wake(as);
+    sched_yield();
+    return 0;
+}
+
+int
+yolog_async_push(struct yolog_async_st *as,
+                 yolog_context *ctx,
+                 unsigned omask,
+                 const struct yolog_msginfo_st *minfo,
+                 const char *fmt,
+                 va_list ap)
+{
+    struct yolog_aring_st *ring;
+    struct yolog_aslot_st *slot;
+    struct yolog_msginfo_st info = *minfo;
+    unsigned long pos, deadline = 0;
+    int rv;
+
+    if (as->stopping) {
+        return -1;
+    }
+
+    /* the time it was logged, not when a slot came free */
+    if (!info.m_time && !info.m_tsc) {
+        yolog_msginfo_stamp(&info);
+    }
+
+    if (as->shed_depth || as->shed_lag) {
+        __sync_fetch_and_add(&ctx->nqueued, 1);
+    }
+
+    ring = minfo->m_level >= as->prio_level ? &as->prio : async_shard(as);
+
+    for (;;) {
+        long dif;
+        pos = ring->head;
+        slot = ring->slots + (pos & ring->mask);
+        dif = (long)(slot->seq - pos);
+
+        if (dif == 0) {
+            if (async_cas(&ring->head, pos, pos + 1)) {
+                break;
+            }
+
+        } else if (dif < 0) {
+            if (async_overflow(as, ring, ctx, omask, minfo->m_level,
+                               &deadline) != 0) {
+                /* dropped; not to be logged synchronously either */
+                return 0;
+            }
+        }
+    }
+
+    slot->ctx = ctx;
+    slot->omask = omask;
+    slot->minfo = info;
+    /**
+     * Numbered once it has a slot, unless it was numbered already for a
+     * binary or per-thread output; the ordering window takes care of the
+     * latter coming in a little out of turn.
+     */
+    if (!slot->minfo.m_seq) {
+        slot->minfo.m_seq = yolog_next_seq();
+    }
+
+    rv = yolog_vformat(slot->body, sizeof(slot->body), fmt, ap);
+    if (rv < 0) {
+        rv = 0;
+    } else if ((size_t)rv >= sizeof(slot->body)) {
+        rv = sizeof(slot->body) - 1;
+    }
+    slot->nbody = rv;
+
+    async_barrier();
+    slot->seq = pos + 1;
+    async_wake(as);
+    return 0;
+}
+
+static int
+async_ring_init(struct yolog_aring_st *ring, unsigned nslots)
+{
+    unsigned long ii, count = 1;
+
+    while (count < nslots) {
+        count <<= 1;
+    }
+
+    ring->slots = calloc(count, sizeof(*ring->slots));
+    if (!ring->slots) {
+        return -1;
+    }
+
+    for (ii = 0; ii < count; ii++) {
+        ring->slots[ii].seq = ii;
+    }
+    ring->mask = count - 1;
+    return 0;
+}
+
+static void
+async_free_rings(struct yolog_async_st *as)
+{
+    unsigned ii;
+
+    if (as->bulk) {
+        for (ii = 0; ii < as->nbulk; ii++) {
+            free(as->bulk[ii].slots);
+        }
+        free(as->bulk);
+    }
+    free(as->prio.slots);
+}
+
+/**
+ * Sets up the bulk queue as 'nshards' shards sharing 'nslots' slots
+ */
+static int
+async_shards_init(struct yolog_async_st *as, unsigned nslots, unsigned nshards)
+{
+    unsigned ii, per_shard = (nslots + nshards - 1) / nshards;
+
+    if (per_shard < YOLOG_ASYNC_SHARD_MIN) {
+        per_shard = YOLOG_ASYNC_SHARD_MIN;
+    }
+
+    as->bulk = calloc(nshards, sizeof(*as->bulk));
+    if (!as->bulk) {
+        return -1;
+    }
+
+    for (ii = 0; ii < nshards; ii++) {
+        if (async_ring_init(as->bulk + ii, nshards > 1 ? per_shard : nslots)
+                != 0) {
+            return -1;
+        }
+        as->nbulk++;
+    }
+    return 0;
+}
+
+static unsigned
+async_ncpus(void)
+{
+    long ncpus = 1;
+#ifdef _SC_NPROCESSORS_CONF
+    ncpus = sysconf(_SC_NPROCESSORS_CONF);
+#endif
+    if (ncpus < 1) {
+        ncpus = 1;
+    } else if (ncpus > YOLOG_ASYNC_SHARDS_MAX) {
+        ncpus = YOLOG_ASYNC_SHARDS_MAX;
+    }
+    return (unsigned)ncpus;
+}
+
+/**
+ * Takes the group out of asynchronous mode, and stops the writer once it
+ * has written everything queued. Returns the writer's state, which is not
+ * freed, or NULL if the group wasn't in asynchronous mode.
+ */
+static struct yolog_async_st *
+async_shutdown(yolog_context_group *grp)
+{
+    struct yolog_async_st *as = grp->async;
+    int ii;
+
+    if (!as) {
+        return NULL;
+    }
+
+    grp->async = NULL;
+    async_barrier();
+
+    pthread_mutex_lock(&as->mutex);
+    as->stopping = 1;
+    pthread_cond_signal(&as->cond);
+    pthread_mutex_unlock(&as->mutex);
+    pthread_join(as->thr, NULL);
+
+    /* whatever was being shed is logged synchronously again */
+    for (ii = 0; ii < grp->ncontexts; ii++) {
+        if (grp->contexts[ii].shed) {
+            yolog_set_shed(grp->contexts + ii, 0);
+        }
+    }
+    return as;
+}
+
+/**
+ * Drains the queues at exit. Nothing is freed: threads which are still
+ * running (or were never joined) may be inside yolog_async_push with the
+ * old pointer.
+ */
+void
+yolog_async_drain_all(void)
+{
+    struct yolog_async_st *as;
+    pthread_mutex_lock(&Yolog_Async_Mutex);
+    as = Yolog_Async_List;
+    pthread_mutex_unlock(&Yolog_Async_Mutex);
+
+    for (; as; as = as->next) {
+        if (as->grp->async == as) {
+            async_shutdown(as->grp);
+        }
+    }
+}
+
+/**
+ * In a forked child there is no writer thread. Every group goes back to
+ * synchronous logging; what was queued is the parent's to write, and the
+ * queues are abandoned rather than freed, as their locks may be held.
+ */
+static void
+async_atfork_child(void)
+{
+    struct yolog_async_st *as;
+
+    for (as = Yolog_Async_List; as; as = as->next) {
+        yolog_context_group *grp = as->grp;
+        int ii;
+
+        if (grp->async != as) {
+            continue;
+        }
+        grp->async = NULL;
+
+        /* as yolog_set_shed(ctx, 0), whose lock may be held as well */
+        for (ii = 0; ii < grp->ncontexts; ii++) {
+            yolog_context *ctx = grp->contexts + ii;
+            int lvl;
+
+            if (!ctx->shed) {
+                continue;
+            }
+            for (lvl = 0; lvl < YOLOG_LEVEL_MAX && !ctx->omasks[lvl]; lvl++) {
+                ;
+            }
+            ctx->shed = 0;
+            ctx->level = lvl;
+        }
+    }
+
+    Yolog_Async_List = NULL;
+    pthread_mutex_init(&Yolog_Async_Mutex, NULL);
+}
+
+YOLOG_API
+int
+yolog_async_start(yolog_context_group *grp, unsigned nslots)
+{
+    return yolog_async_start_backend(grp, nslots, NULL, 0);
+}
+
+int
+yolog_async_start_backend(yolog_context_group *grp,
+                          unsigned nslots,
+                          const char *backend,
+                          int percpu)
+{
+    struct yolog_async_st *as;
+
+    if (!grp) {
+        grp = yolog_get_global()->parent;
+    }
+
+    if (!nslots) {
+        nslots = YOLOG_ASYNC_QUEUE_DEFAULT;
+    }
+    if (!backend) {
+        backend = "";
+    }
+
+    as = grp->async;
+    if (as) {
+        /* the queue and the writer can't be swapped under running threads */
+        if (as->nslots != nslots || as->percpu != !!percpu ||
+                strcmp(as->backend, backend) != 0) {
+            fprintf(stderr, "Yolog: Changing QueueSize, Backend or PerCPU "
+                    "requires a restart (or yolog_async_stop)\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    as = calloc(1, sizeof(*as));
+    if (!as) {
+        return -1;
+    }
+
+    if (async_shards_init(as, nslots, percpu ? async_ncpus() : 1) != 0 ||
+            async_ring_init(&as->prio, YOLOG_ASYNC_PRIO_QUEUE) != 0) {
+        async_free_rings(as);
+        free(as);
+        return -1;
+    }
+
+    as->nslots = nslots;
+    as->percpu = !!percpu;
+    strncpy(as->backend, backend, sizeof(as->backend) - 1);
+
+    as->held = calloc(YOLOG_ASYNC_ORDER_MAX, sizeof(*as->held));
+    as->io = as->held ? yolog_io_create(*backend ? backend : NULL) : NULL;
+    if (!as->io) {
+        async_free_rings(as);
+        free(as->held);
+        free(as);
+        return -1;
+    }
+
+    as->grp = grp;
+    as->prio_level = YOLOG_ERROR;
+    as->prio_window = YOLOG_ASYNC_PRIO_WINDOW;
+    pthread_mutex_init(&as->mutex, NULL);
+    pthread_cond_init(&as->cond, NULL);
+
+    if (pthread_create(&as->thr, NULL, async_writer, as) != 0) {
+        fprintf(stderr, "Yolog: Couldn't start writer thread: %s\n",
+                strerror(errno));
+        pthread_mutex_destroy(&as->mutex);
+        pthread_cond_destroy(&as->cond);
+        yolog_io_destroy(as->io);
+        async_free_rings(as);
+        free(as->held);
+        free(as);
+        return -1;
+    }
+
+    pthread_mutex_lock(&Yolog_Async_Mutex);
+    as->next = Yolog_Async_List;
+    Yolog_Async_List = as;
+    if (!Yolog_Async_Atexit) {
+        atexit(yolog_async_drain_all);
+        pthread_atfork(NULL, NULL, async_atfork_child);
+        Yolog_Async_Atexit = 1;
+    }
+    pthread_mutex_unlock(&Yolog_Async_Mutex);
+
+    async_barrier();
+    grp->async = as;
+    return 0;
+}
+
+YOLOG_API
+int
+yolog_async_set_overflow(yolog_context_group *grp,
+                         int policy,
+                         unsigned timeout_ms,
+                         int level)
+{
+    struct yolog_async_st *as;
+
+    if (!grp) {
+        grp = yolog_get_global()->parent;
+    }
+
+    as = grp->async;
+    if (!as || policy < YOLOG_OVERFLOW_BLOCK ||
+            policy > YOLOG_OVERFLOW_DROP_BELOW) {
+        return -1;
+    }
+
+    as->overflow_timeout = timeout_ms;
+    as->overflow_level = level;
+    async_barrier();
+    as->overflow = policy;
+    return 0;
+}
+
+YOLOG_API
+int
+yolog_async_set_priority(yolog_context_group *grp,
+                         int level,
+                         unsigned long window)
+{
+    struct yolog_async_st *as;
+
+    if (!grp) {
+        grp = yolog_get_global()->parent;
+    }
+
+    as = grp->async;
+    if (!as) {
+        return -1;
+    }
+
+    as->prio_window = window;
+    async_barrier();
+    as->prio_level = level;
+    return 0;
+}
+
+YOLOG_API
+int
+yolog_async_set_shedding(yolog_context_group *grp,
+                         unsigned depth_pct,
+                         unsigned lag_ms)
+{
+    struct yolog_async_st *as;
+
+    if (!grp) {
+        grp = yolog_get_global()->parent;
+    }
+
+    as = grp->async;
+    if (!as) {
+        return -1;
+    }
+
+    as->shed_sampled = async_now_ms();
+    as->shed_depth = depth_pct;
+    as->shed_lag = lag_ms;
+    return 0;
+}
+
+YOLOG_API
+int
+yolog_async_set_ordering(yolog_context_group *grp, unsigned window)
+{
+    struct yolog_async_st *as;
+
+    if (!grp) {
+        grp = yolog_get_global()->parent;
+    }
+
+    as = grp->async;
+    if (!as) {
+        return -1;
+    }
+
+    if (window > YOLOG_ASYNC_ORDER_MAX) {
+        window = YOLOG_ASYNC_ORDER_MAX;
+    }
+    as->order_window = window;
+    return 0;
+}
+
+YOLOG_API
+void
+yolog_async_stop(yolog_context_group *grp)
+{
+    struct yolog_async_st *as, **asp;
+
+    if (!grp) {
+        grp = yolog_get_global()->parent;
+    }
+
+    as = async_shutdown(grp);
+    if (!as) {
+        return;
+    }
+
+    pthread_mutex_lock(&Yolog_Async_Mutex);
+    for (asp = &Yolog_Async_List; *asp; asp = &(*asp)->next) {
+        if (*asp == as) {
+            *asp = as->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&Yolog_Async_Mutex);
+
+    pthread_mutex_destroy(&as->mutex);
+    pthread_cond_destroy(&as->cond);
+    yolog_io_destroy(as->io);
+    async_free_rings(as);
+    free(as->held);
+    free(as);
+}
+
+#else
+
+void
+yolog_async_drain_all(void)
+{
+}
+
+int
+yolog_async_push(struct yolog_async_st *as,
+                 yolog_context *ctx,
+                 unsigned omask,
+                 const struct yolog_msginfo_st *minfo,
+                 const char *fmt,
+                 va_list ap)
+{
+    (void)as; (void)ctx; (void)omask; (void)minfo; (void)fmt; (void)ap;
+    return -1;
+}
+
+YOLOG_API
+int
+yolog_async_start(yolog_context_group *grp, unsigned nslots)
+{
+    return yolog_async_start_backend(grp, nslots, NULL, 0);
+}
+
+int
+yolog_async_start_backend(yolog_context_group *grp,
+                          unsigned nslots,
+                          const char *backend,
+                          int percpu)
+{
+    (void)grp; (void)nslots; (void)backend; (void)percpu;
+    fprintf(stderr, "Yolog: Asynchronous logging not supported\n");
+    return -1;
+}
+
+YOLOG_API
+int
+yolog_async_set_overflow(yolog_context_group *grp,
+                         int policy,
+                         unsigned timeout_ms,
+                         int level)
+{
+    (void)grp; (void)policy; (void)timeout_ms; (void)level;
+    return -1;
+}
+
+YOLOG_API
+int
+yolog_async_set_priority(yolog_context_group *grp,
+                         int level,
+                         unsigned long window)
+{
+    (void)grp; (void)level; (void)window;
+    return -1;
+}
+
+YOLOG_API
+int
+yolog_async_set_shedding(yolog_context_group *grp,
+                         unsigned depth_pct,
+                         unsigned lag_ms)
+{
+    (void)grp; (void)depth_pct; (void)lag_ms;
+    return -1;
+}
+
+YOLOG_API
+int
+yolog_async_set_ordering(yolog_context_group *grp, unsigned window)
+{
+    (void)grp; (void)window;
+    return -1;
+}
+
+YOLOG_API
+void
+yolog_async_stop(yolog_context_group *grp)
+{
+    (void)grp;
+}
+
+#endif /* YOLOG_ASYNC_SUPPORTED */
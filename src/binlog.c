@@ -0,0 +1,570 @@
+/**
+ * Binary (deferred formatting) outputs. See the description of the format
+ * in yolog.h.
+ *
+ * Each binary output keeps a table of the call sites which have logged to
+ * it. A call site's printf format is only parsed the first time it is seen;
+ * after that, logging a message is a table lookup and a copy of the raw
+ * argument values. The table is only touched while holding the output's
+ * FILE lock, which we need for writing anyway.
+ *
+ * Sites are found by the format's address, but also have to match its text:
+ * a format in a reused buffer may have changed since, and decoding the
+ * arguments with the old types would be undefined. Each distinct text is
+ * then a site of its own.
+ */
+
+/* needed for vsnprintf and clock_gettime in strict C89 builds */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
+#endif /* __unix__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdint.h>
+
+#include "yolog.h"
+
+#ifdef __unix__
+#define binlog_lock(out) flockfile((out)->fp)
+#define binlog_unlock(out) funlockfile((out)->fp)
+#else
+#define binlog_lock(out)
+#define binlog_unlock(out)
+#endif
+
+#ifdef __GNUC__
+__extension__ typedef long long binlog_llong;
+#else
+typedef long binlog_llong;
+#endif
+
+struct binlog_site_st {
+    const char *fmt;
+    char *text;
+    const char *file;
+    int line;
+    yolog_context *ctx;
+    uint32_t id;
+    char *types;
+};
+
+struct yolog_binlog_st {
+    struct binlog_site_st *sites;
+    size_t nalloc;
+    size_t nused;
+};
+
+const char *
+yolog_binlog_scan(const char *fmt,
+                  const char **spec,
+                  int *type,
+                  int *nstars)
+{
+    const char *p = strchr(fmt, '%');
+    int lmod = 0;
+
+    if (!p) {
+        return NULL;
+    }
+
+    *spec = p;
+    *nstars = 0;
+    p++;
+
+    while (*p && strchr("-+ #0'I", *p)) {
+        p++;
+    }
+
+    if (*p == '*') {
+        (*nstars)++;
+        p++;
+    } else {
+        while (isdigit((unsigned char)*p)) {
+            p++;
+        }
+        if (*p == '$') {
+            /* positional arguments */
+            *type = YOLOG_BINLOG_T_TEXT;
+            return p + 1;
+        }
+    }
+
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            (*nstars)++;
+            p++;
+        } else {
+            while (isdigit((unsigned char)*p)) {
+                p++;
+            }
+        }
+    }
+
+    switch (*p) {
+    case 'h':
+        p++;
+        if (*p == 'h') {
+            p++;
+        }
+        lmod = 'h';
+        break;
+
+    case 'l':
+        p++;
+        if (*p == 'l') {
+            p++;
+            lmod = 'q';
+        } else {
+            lmod = 'l';
+        }
+        break;
+
+    case 'q':
+    case 'j':
+        p++;
+        lmod = 'q';
+        break;
+
+    case 'L':
+    case 'z':
+    case 'Z':
+    case 't':
+        lmod = (*p == 'Z') ? 'z' : *p;
+        p++;
+        break;
+
+    default:
+        break;
+    }
+
+    if (*p == '\0') {
+        *type = YOLOG_BINLOG_T_TEXT;
+        return p;
+    }
+
+    switch (*p) {
+    case '%':
+        *type = YOLOG_BINLOG_T_NONE;
+        break;
+
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+        if (lmod == 'l') {
+            *type = (*p == 'c') ? YOLOG_BINLOG_T_TEXT : YOLOG_BINLOG_T_LONG;
+        } else if (lmod == 'q' || lmod == 'L') {
+            *type = YOLOG_BINLOG_T_LLONG;
+        } else if (lmod == 'z') {
+            *type = YOLOG_BINLOG_T_SIZE;
+        } else if (lmod == 't') {
+            *type = YOLOG_BINLOG_T_PTRDIFF;
+        } else {
+            *type = YOLOG_BINLOG_T_INT;
+        }
+        break;
+
+    case 'e': case 'E': case 'f': case 'F':
+    case 'g': case 'G': case 'a': case 'A':
+        *type = (lmod == 'L') ? YOLOG_BINLOG_T_TEXT : YOLOG_BINLOG_T_DOUBLE;
+        break;
+
+    case 's':
+        *type = (lmod == 'l') ? YOLOG_BINLOG_T_TEXT : YOLOG_BINLOG_T_STRING;
+        break;
+
+    case 'p':
+        *type = YOLOG_BINLOG_T_PTR;
+        break;
+
+    default:
+        /* %n, %m, wide characters.. */
+        *type = YOLOG_BINLOG_T_TEXT;
+        break;
+    }
+
+    return p + 1;
+}
+
+/**
+ * Builds the argument type list for a format. Each '*' contributes an int.
+ */
+static char *
+binlog_parse_types(const char *fmt)
+{
+    size_t nalloc = 8, nused = 0;
+    char *types = malloc(nalloc);
+    const char *spec;
+    int type, nstars;
+
+    if (!types) {
+        return NULL;
+    }
+
+    while ((fmt = yolog_binlog_scan(fmt, &spec, &type, &nstars))) {
+        if (type == YOLOG_BINLOG_T_TEXT) {
+            strcpy(types, "T");
+            return types;
+        }
+
+        if (nused + nstars + 2 > nalloc) {
+            char *tmp;
+            nalloc *= 2;
+            tmp = realloc(types, nalloc);
+            if (!tmp) {
+                free(types);
+                return NULL;
+            }
+            types = tmp;
+        }
+
+        while (nstars--) {
+            types[nused++] = YOLOG_BINLOG_T_INT;
+        }
+
+        if (type != YOLOG_BINLOG_T_NONE) {
+            types[nused++] = type;
+        }
+    }
+
+    types[nused] = '\0';
+    return types;
+}
+
+static size_t
+binlog_hash(const char *fmt, const char *file, int line, yolog_context *ctx)
+{
+    size_t h = (size_t)fmt;
+    h = (h * 31) ^ (size_t)file;
+    h = (h * 31) ^ (size_t)line;
+    h = (h * 31) ^ (size_t)ctx;
+    return h ^ (h >> 7) ^ (h >> 17);
+}
+
+static void
+binlog_put_str(FILE *fp, const char *s)
+{
+    size_t len = s ? strlen(s) : 0;
+    uint16_t n16;
+
+    if (len > 0xffff) {
+        len = 0xffff;
+    }
+    n16 = len;
+    fwrite(&n16, sizeof(n16), 1, fp);
+    fwrite(s, 1, len, fp);
+}
+
+static struct binlog_site_st *
+binlog_get_site(struct yolog_output_st *out,
+                yolog_context *ctx,
+                const struct yolog_msginfo_st *minfo,
+                const char *fmt)
+{
+    struct yolog_binlog_st *bl = out->binlog;
+    struct binlog_site_st *site;
+    size_t mask = bl->nalloc - 1;
+    size_t ix = binlog_hash(fmt, minfo->m_file, minfo->m_line, ctx) & mask;
+
+    for (;; ix = (ix + 1) & mask) {
+        site = bl->sites + ix;
+        if (site->types == NULL) {
+            break;
+        }
+        if (site->fmt == fmt && site->file == minfo->m_file &&
+                site->line == minfo->m_line && site->ctx == ctx &&
+                strcmp(site->text, fmt) == 0) {
+            return site;
+        }
+    }
+
+    /* not found; keep the table at most half full */
+    if ((bl->nused + 1) * 2 > bl->nalloc) {
+        struct binlog_site_st *old = bl->sites;
+        size_t ii, oldcount = bl->nalloc;
+
+        bl->sites = calloc(oldcount * 2, sizeof(*bl->sites));
+        if (!bl->sites) {
+            bl->sites = old;
+            return NULL;
+        }
+        bl->nalloc = oldcount * 2;
+        mask = bl->nalloc - 1;
+
+        for (ii = 0; ii < oldcount; ii++) {
+            size_t jj;
+            if (!old[ii].types) {
+                continue;
+            }
+            jj = binlog_hash(old[ii].fmt, old[ii].file,
+                             old[ii].line, old[ii].ctx) & mask;
+            while (bl->sites[jj].types) {
+                jj = (jj + 1) & mask;
+            }
+            bl->sites[jj] = old[ii];
+        }
+        free(old);
+
+        ix = binlog_hash(fmt, minfo->m_file, minfo->m_line, ctx) & mask;
+        while (bl->sites[ix].types) {
+            ix = (ix + 1) & mask;
+        }
+        site = bl->sites + ix;
+    }
+
+    site->text = malloc(strlen(fmt) + 1);
+    if (!site->text) {
+        return NULL;
+    }
+    strcpy(site->text, fmt);
+
+    site->types = binlog_parse_types(fmt);
+    if (!site->types) {
+        free(site->text);
+        site->text = NULL;
+        return NULL;
+    }
+
+    site->fmt = fmt;
+    site->file = minfo->m_file;
+    site->line = minfo->m_line;
+    site->ctx = ctx;
+    site->id = bl->nused++;
+
+    {
+        uint32_t u32;
+        fputc(YOLOG_BINLOG_REC_DEFINE, out->fp);
+        u32 = site->id;
+        fwrite(&u32, sizeof(u32), 1, out->fp);
+        u32 = site->line;
+        fwrite(&u32, sizeof(u32), 1, out->fp);
+        binlog_put_str(out->fp, minfo->m_prefix);
+        binlog_put_str(out->fp, minfo->m_file);
+        binlog_put_str(out->fp, minfo->m_func);
+        binlog_put_str(out->fp, fmt);
+        binlog_put_str(out->fp, site->types);
+    }
+
+    return site;
+}
+
+#define binlog_put(buf, pos, nbuf, v) do { \
+    if ((pos) + sizeof(v) <= (nbuf)) { \
+        memcpy((buf) + (pos), &(v), sizeof(v)); \
+        (pos) += sizeof(v); \
+    } \
+} while (0)
+
+/**
+ * Copies the arguments into buf, returning the number of bytes used.
+ * Strings which don't fit are truncated.
+ */
+static size_t
+binlog_encode(char *buf, size_t nbuf,
+              const char *types, const char *fmt, va_list ap)
+{
+    size_t pos = 0;
+    binlog_llong ival;
+    double dval;
+
+    for (; *types; types++) {
+        switch (*types) {
+        case YOLOG_BINLOG_T_INT:
+            ival = va_arg(ap, int);
+            binlog_put(buf, pos, nbuf, ival);
+            break;
+
+        case YOLOG_BINLOG_T_LONG:
+            ival = va_arg(ap, long);
+            binlog_put(buf, pos, nbuf, ival);
+            break;
+
+        case YOLOG_BINLOG_T_LLONG:
+            ival = va_arg(ap, binlog_llong);
+            binlog_put(buf, pos, nbuf, ival);
+            break;
+
+        case YOLOG_BINLOG_T_SIZE:
+            ival = va_arg(ap, size_t);
+            binlog_put(buf, pos, nbuf, ival);
+            break;
+
+        case YOLOG_BINLOG_T_PTRDIFF:
+            ival = va_arg(ap, ptrdiff_t);
+            binlog_put(buf, pos, nbuf, ival);
+            break;
+
+        case YOLOG_BINLOG_T_PTR:
+            ival = (size_t)va_arg(ap, void*);
+            binlog_put(buf, pos, nbuf, ival);
+            break;
+
+        case YOLOG_BINLOG_T_DOUBLE:
+            dval = va_arg(ap, double);
+            binlog_put(buf, pos, nbuf, dval);
+            break;
+
+        case YOLOG_BINLOG_T_STRING:
+        case YOLOG_BINLOG_T_TEXT: {
+            uint32_t slen;
+            size_t space;
+
+            if (pos + sizeof(slen) >= nbuf) {
+                return pos;
+            }
+            space = nbuf - pos - sizeof(slen);
+
+            if (*types == YOLOG_BINLOG_T_TEXT) {
+                int rv = yolog_vformat(buf + pos + sizeof(slen), space,
+                                       fmt, ap);
+                if (rv < 0) {
+                    rv = 0;
+                } else if ((size_t)rv >= space) {
+                    rv = space - 1;
+                }
+                slen = rv;
+            } else {
+                const char *s = va_arg(ap, const char *);
+                if (!s) {
+                    s = "(null)";
+                }
+                slen = strlen(s);
+                if (slen > space) {
+                    slen = space;
+                }
+                memcpy(buf + pos + sizeof(slen), s, slen);
+            }
+
+            memcpy(buf + pos, &slen, sizeof(slen));
+            pos += sizeof(slen) + slen;
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+    return pos;
+}
+
+int
+yolog_binlog_init(struct yolog_output_st *out)
+{
+    uint32_t u32;
+
+    if (!out->binlog) {
+        out->binlog = calloc(1, sizeof(*out->binlog));
+        if (!out->binlog) {
+            return -1;
+        }
+    } else {
+        /* a new session on a new file; IDs start over */
+        size_t ii;
+        for (ii = 0; ii < out->binlog->nalloc; ii++) {
+            free(out->binlog->sites[ii].types);
+            free(out->binlog->sites[ii].text);
+        }
+        free(out->binlog->sites);
+    }
+
+    out->binlog->nused = 0;
+    out->binlog->nalloc = 64;
+    out->binlog->sites = calloc(out->binlog->nalloc,
+                                sizeof(*out->binlog->sites));
+    if (!out->binlog->sites) {
+        free(out->binlog);
+        out->binlog = NULL;
+        return -1;
+    }
+
+    fwrite(YOLOG_BINLOG_MAGIC, 1, sizeof(YOLOG_BINLOG_MAGIC)-1, out->fp);
+    u32 = YOLOG_BINLOG_VERSION;
+    fwrite(&u32, sizeof(u32), 1, out->fp);
+    u32 = 0x01020304;
+    fwrite(&u32, sizeof(u32), 1, out->fp);
+    fflush(out->fp);
+
+    out->flags |= YOLOG_OUTPUT_F_BINARY;
+    return 0;
+}
+
+void
+yolog_binlog_write(struct yolog_output_st *out,
+                   yolog_context *ctx,
+                   const struct yolog_msginfo_st *minfo,
+                   const char *fmt,
+                   va_list ap)
+{
+    struct binlog_site_st *site;
+    char rec[YOLOG_LINE_MAX];
+    size_t pos = 0, plen_pos;
+    uint32_t u32;
+    uint64_t u64;
+    unsigned char level = minfo->m_level;
+    unsigned long dseq = 0;
+
+    unsigned long sec = minfo->m_time, nsec = minfo->m_nsec;
+
+    /* from the configured clock, as for text outputs */
+    if (!sec && yolog_tsc_time(minfo->m_tsc, 0, &sec, &nsec) != 0) {
+#ifdef __unix__
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        sec = ts.tv_sec;
+        nsec = ts.tv_nsec;
+#else
+        sec = (unsigned long)time(NULL);
+        nsec = 0;
+#endif
+    }
+
+    binlog_lock(out);
+
+    site = binlog_get_site(out, ctx, minfo, fmt);
+    if (!site) {
+        binlog_unlock(out);
+        return;
+    }
+
+    rec[pos++] = YOLOG_BINLOG_REC_MESSAGE;
+    u32 = site->id;
+    binlog_put(rec, pos, sizeof(rec), u32);
+    binlog_put(rec, pos, sizeof(rec), level);
+    u64 = sec;
+    binlog_put(rec, pos, sizeof(rec), u64);
+    u32 = nsec;
+    binlog_put(rec, pos, sizeof(rec), u32);
+    u64 = minfo->m_tid ? minfo->m_tid : yolog_thread_id();
+    binlog_put(rec, pos, sizeof(rec), u64);
+    u64 = minfo->m_seq;
+    binlog_put(rec, pos, sizeof(rec), u64);
+
+    plen_pos = pos;
+    pos += sizeof(u32);
+
+    u32 = binlog_encode(rec + pos, sizeof(rec) - pos, site->types, fmt, ap);
+    memcpy(rec + plen_pos, &u32, sizeof(u32));
+    pos += u32;
+
+    fwrite(rec, 1, pos, out->fp);
+    yolog_output_written(out, minfo->m_level);
+    if (out->durable) {
+        dseq = yolog_durable_mark(out, minfo->m_level);
+    }
+
+    binlog_unlock(out);
+
+    if (out->rotate) {
+        yolog_rotate_account(out, pos);
+    }
+
+    if (dseq) {
+        yolog_durable_wait(out, dseq);
+    }
+}
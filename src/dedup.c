@@ -0,0 +1,363 @@
+/**
+ * Collapsing of repeated messages.
+ *
+ * An output with deduplication remembers a hash of the last message it
+ * wrote, made of the rendered body and the call site (context, level, file
+ * and line). When the next message hashes the same, it is only counted.
+ * The count is written out as a "Last message repeated N times" line once a
+ * different message comes along, or once the first uncounted repeat is
+ * older than the output's timeout; the latter is done by a single thread
+ * shared by all such outputs, which sleeps until the earliest deadline.
+ *
+ * The summary line is written with the header of the repeated message, so
+ * it shows the same level and call site, but the current time. Repeats which
+ * are still pending at exit are reported then.
+ *
+ * When the output's group is asynchronous, the writer may still have
+ * repeats batched; the timer thread then only marks the output as due, and
+ * the writer reports it in turn (see yolog_dedup_report_due).
+ */
+
+/* needed for clock_gettime in strict C89 builds */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
+#endif /* __unix__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "yolog.h"
+
+#if defined(__unix__) && defined(__GNUC__)
+#define YOLOG_DEDUP_SUPPORTED
+#endif
+
+#ifdef YOLOG_DEDUP_SUPPORTED
+#include <pthread.h>
+#include <time.h>
+
+/* how long repeats are counted before they are reported, by default */
+#define YOLOG_DEDUP_TIMEOUT_DEFAULT 5000
+
+/* how often (ms) a report left to the writer is checked on */
+#define DEDUP_DUE_RECHECK_MS 250
+
+struct yolog_dedup_st {
+    struct yolog_output_st *out;
+    pthread_mutex_t mutex;
+
+    unsigned long timeout;
+
+    /* hash of the last message written, 0 if none */
+    unsigned long hash;
+
+    /* the last message's context, output index and info, for the summary */
+    yolog_context *ctx;
+    int oix;
+    struct yolog_msginfo_st minfo;
+
+    /* repeats not yet reported, and when (ms) the first of them came in */
+    unsigned long count;
+    unsigned long since;
+
+    /* set when the asynchronous writer is to report the repeats */
+    int due;
+
+    struct yolog_dedup_st *next;
+};
+
+/* all deduplicating outputs, for the timer thread */
+static struct yolog_dedup_st *Yolog_Dedup_List;
+static pthread_mutex_t Yolog_Dedup_Mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Yolog_Dedup_Cond = PTHREAD_COND_INITIALIZER;
+static int Yolog_Dedup_Thread;
+
+/* set while any output is due, so the writer can check it cheaply */
+static volatile int Yolog_Dedup_Due;
+
+static unsigned long
+dedup_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * FNV-1a over the body, mixed with the call site
+ */
+static unsigned long
+dedup_hash(yolog_context *ctx,
+           const struct yolog_msginfo_st *minfo,
+           const char *body,
+           size_t nbody)
+{
+    unsigned long hash = 2166136261UL;
+    size_t ii;
+
+    for (ii = 0; ii < nbody; ii++) {
+        hash ^= (unsigned char)body[ii];
+        hash *= 16777619UL;
+    }
+
+    hash ^= (unsigned long)ctx;
+    hash *= 16777619UL;
+    hash ^= (unsigned long)minfo->m_file;
+    hash *= 16777619UL;
+    hash ^= ((unsigned long)minfo->m_line << 4) | minfo->m_level;
+    hash *= 16777619UL;
+
+    /* 0 means there is no previous message */
+    return hash ? hash : 1;
+}
+
+/**
+ * Writes the summary line for the pending repeats. Called with the lock held.
+ */
+static void
+dedup_report(struct yolog_dedup_st *dd, struct yolog_io_st *io)
+{
+    struct yolog_msginfo_st minfo = dd->minfo;
+    char body[96];
+
+    /* the header shows when the repeats were reported */
+    minfo.m_seq = yolog_next_seq();
+    minfo.m_tsc = 0;
+    yolog_msginfo_stamp(&minfo);
+    minfo.m_tid = dd->minfo.m_tid;
+    memcpy(minfo.m_tname, dd->minfo.m_tname, sizeof(minfo.m_tname));
+
+    sprintf(body, "Last message repeated %lu time%s",
+            dd->count, dd->count == 1 ? "" : "s");
+    dd->count = 0;
+    dd->due = 0;
+    yolog_emit_output(dd->ctx, dd->oix, &minfo, body, strlen(body), io);
+}
+
+static void
+dedup_atexit(void)
+{
+    struct yolog_dedup_st *dd;
+
+    /* anything still queued is written before the summaries */
+    yolog_async_drain_all();
+
+    pthread_mutex_lock(&Yolog_Dedup_Mutex);
+    for (dd = Yolog_Dedup_List; dd; dd = dd->next) {
+        pthread_mutex_lock(&dd->mutex);
+        if (dd->count) {
+            dedup_report(dd, NULL);
+        }
+        pthread_mutex_unlock(&dd->mutex);
+    }
+    pthread_mutex_unlock(&Yolog_Dedup_Mutex);
+}
+
+static void *
+dedup_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&Yolog_Dedup_Mutex);
+    for (;;) {
+        struct yolog_dedup_st *dd;
+        unsigned long now = dedup_now_ms(), wait = 0;
+        struct timespec ts;
+
+        for (dd = Yolog_Dedup_List; dd; dd = dd->next) {
+            unsigned long age;
+
+            pthread_mutex_lock(&dd->mutex);
+            if (dd->count) {
+                age = now - dd->since;
+                if (age >= dd->timeout && dd->ctx->parent->async) {
+                    /* checked again, in case the group goes synchronous */
+                    dd->due = 1;
+                    Yolog_Dedup_Due = 1;
+                    if (!wait || DEDUP_DUE_RECHECK_MS < wait) {
+                        wait = DEDUP_DUE_RECHECK_MS;
+                    }
+                } else if (age >= dd->timeout) {
+                    dedup_report(dd, NULL);
+                } else if (!wait || dd->timeout - age < wait) {
+                    wait = dd->timeout - age;
+                }
+            }
+            pthread_mutex_unlock(&dd->mutex);
+        }
+
+        if (!wait) {
+            /* nothing pending; woken up when a repeat is counted */
+            pthread_cond_wait(&Yolog_Dedup_Cond, &Yolog_Dedup_Mutex);
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += wait / 1000;
+        ts.tv_nsec += (wait % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&Yolog_Dedup_Cond, &Yolog_Dedup_Mutex, &ts);
+    }
+    return NULL;
+}
+
+int
+yolog_dedup_init(struct yolog_output_st *out, unsigned long timeout)
+{
+    struct yolog_dedup_st *dd;
+
+    if (!timeout) {
+        timeout = YOLOG_DEDUP_TIMEOUT_DEFAULT;
+    }
+
+    if (out->dedup) {
+        /* only the timeout changes */
+        pthread_mutex_lock(&out->dedup->mutex);
+        out->dedup->timeout = timeout;
+        pthread_mutex_unlock(&out->dedup->mutex);
+        out->flags |= YOLOG_OUTPUT_F_DEDUP;
+        return 0;
+    }
+
+    dd = calloc(1, sizeof(*dd));
+    if (!dd) {
+        return -1;
+    }
+
+    dd->out = out;
+    dd->timeout = timeout;
+    pthread_mutex_init(&dd->mutex, NULL);
+
+    pthread_mutex_lock(&Yolog_Dedup_Mutex);
+    if (!Yolog_Dedup_Thread) {
+        pthread_t thr;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thr, &attr, dedup_main, NULL) != 0) {
+            pthread_attr_destroy(&attr);
+            pthread_mutex_unlock(&Yolog_Dedup_Mutex);
+            pthread_mutex_destroy(&dd->mutex);
+            free(dd);
+            return -1;
+        }
+        pthread_attr_destroy(&attr);
+        Yolog_Dedup_Thread = 1;
+        atexit(dedup_atexit);
+    }
+
+    dd->next = Yolog_Dedup_List;
+    Yolog_Dedup_List = dd;
+    out->dedup = dd;
+    out->flags |= YOLOG_OUTPUT_F_DEDUP;
+    pthread_mutex_unlock(&Yolog_Dedup_Mutex);
+    return 0;
+}
+
+int
+yolog_dedup_check(struct yolog_output_st *out,
+                  yolog_context *ctx,
+                  int oix,
+                  const struct yolog_msginfo_st *minfo,
+                  const char *body,
+                  size_t nbody,
+                  struct yolog_io_st *io)
+{
+    struct yolog_dedup_st *dd = out->dedup;
+    unsigned long hash = dedup_hash(ctx, minfo, body, nbody);
+    int wake = 0;
+
+    pthread_mutex_lock(&dd->mutex);
+    if (hash == dd->hash) {
+        if (dd->count++ == 0) {
+            dd->since = dedup_now_ms();
+            wake = 1;
+        }
+        pthread_mutex_unlock(&dd->mutex);
+
+        if (wake) {
+            pthread_mutex_lock(&Yolog_Dedup_Mutex);
+            pthread_cond_signal(&Yolog_Dedup_Cond);
+            pthread_mutex_unlock(&Yolog_Dedup_Mutex);
+        }
+        return 1;
+    }
+
+    if (dd->count) {
+        dedup_report(dd, io);
+    }
+
+    dd->hash = hash;
+    dd->ctx = ctx;
+    dd->oix = oix;
+    dd->minfo = *minfo;
+    pthread_mutex_unlock(&dd->mutex);
+    return 0;
+}
+
+int
+yolog_dedup_report_due(yolog_context_group *grp, struct yolog_io_st *io)
+{
+    struct yolog_dedup_st *dd;
+    int due = 0, written = 0;
+
+    if (!Yolog_Dedup_Due) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&Yolog_Dedup_Mutex);
+    for (dd = Yolog_Dedup_List; dd; dd = dd->next) {
+        pthread_mutex_lock(&dd->mutex);
+        if (dd->due && dd->ctx->parent == grp) {
+            if (dd->count) {
+                dedup_report(dd, io);
+                written = 1;
+            }
+            dd->due = 0;
+        }
+        due |= dd->due;
+        pthread_mutex_unlock(&dd->mutex);
+    }
+    Yolog_Dedup_Due = due;
+    pthread_mutex_unlock(&Yolog_Dedup_Mutex);
+    return written;
+}
+
+#else
+
+int
+yolog_dedup_init(struct yolog_output_st *out, unsigned long timeout)
+{
+    (void)out; (void)timeout;
+    return -1;
+}
+
+int
+yolog_dedup_check(struct yolog_output_st *out,
+                  yolog_context *ctx,
+                  int oix,
+                  const struct yolog_msginfo_st *minfo,
+                  const char *body,
+                  size_t nbody,
+                  struct yolog_io_st *io)
+{
+    (void)out; (void)ctx; (void)oix; (void)minfo;
+    (void)body; (void)nbody; (void)io;
+    return 0;
+}
+
+int
+yolog_dedup_report_due(yolog_context_group *grp, struct yolog_io_st *io)
+{
+    (void)grp; (void)io;
+    return 0;
+}
+
+#endif /* YOLOG_DEDUP_SUPPORTED */
@@ -1,6 +1,15 @@
+/* needed for snprintf in strict C89 builds */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
+#endif /* __unix__ */
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <time.h>
 
 #ifdef __unix__
@@ -22,27 +31,26 @@
 
 int syscall(int, ...);
 #endif
-#define yolog_fprintf_thread(f) fprintf(f, "%d", syscall(SYS_gettid))
+#define yolog_get_tid() ((unsigned long)syscall(SYS_gettid))
+#define YOLOG_TID_HEX 0
 
 #else /* other POSIX non-linux systems */
-static void
-yolog_fprintf_thread(FILE *f) {
+static unsigned long
+yolog_get_tid(void) {
     pthread_t pt = pthread_self();
-    unsigned char *ptc = (unsigned char*)(void*)(&pt);
-    size_t ii;
-    fprintf(f, "0x");
-
-    for (ii = 0; ii < sizeof(pt); ii++) {
-        fprintf(f, "%02x", (unsigned)(ptc[ii]));
-    }
+    unsigned long ret = 0;
+    memcpy(&ret, &pt, sizeof(pt) < sizeof(ret) ? sizeof(pt) : sizeof(ret));
+    return ret;
 }
+#define YOLOG_TID_HEX 1
 #endif /* __linux__ */
 
 
 #define yolog_get_pid getpid
 
 #else
-#define yolog_fprintf_thread(f)
+#define yolog_get_tid() 0
+#define YOLOG_TID_HEX 0
 #define yolog_get_pid() -1
 
 #endif /* __unix__ */
@@ -50,6 +58,105 @@ yolog_fprintf_thread(FILE *f) {
 
 #include "yolog.h"
 
+/**
+ * The thread ID, PID and thread name are cached: the PID for the process and
+ * the others per thread. A fork() handler clears them in the child, which
+ * has a new PID and a new thread ID for its (only) thread.
+ */
+static long Fmt_Pid;
+
+#ifdef YOLOG_TLS
+static YOLOG_TLS unsigned long Fmt_Tid;
+static YOLOG_TLS char Fmt_Tname[YOLOG_TNAME_MAX];
+#endif
+
+#ifdef __unix__
+static pthread_once_t Fmt_Atfork_Once = PTHREAD_ONCE_INIT;
+
+static void
+fmt_atfork_child(void)
+{
+    Fmt_Pid = 0;
+#ifdef YOLOG_TLS
+    Fmt_Tid = 0;
+    Fmt_Tname[0] = '\0';
+#endif
+}
+
+static void
+fmt_atfork_register(void)
+{
+    pthread_atfork(NULL, NULL, fmt_atfork_child);
+}
+#define fmt_atfork_init() pthread_once(&Fmt_Atfork_Once, fmt_atfork_register)
+#else
+#define fmt_atfork_init()
+#endif /* __unix__ */
+
+static long
+fmt_pid(void)
+{
+    if (!Fmt_Pid) {
+        fmt_atfork_init();
+        Fmt_Pid = (long)yolog_get_pid();
+    }
+    return Fmt_Pid;
+}
+
+static unsigned long
+fmt_tid(void)
+{
+#ifdef YOLOG_TLS
+    if (!Fmt_Tid) {
+        fmt_atfork_init();
+        Fmt_Tid = yolog_get_tid();
+    }
+    return Fmt_Tid;
+#else
+    return yolog_get_tid();
+#endif
+}
+
+/**
+ * Copies the calling thread's name into buf, which is YOLOG_TNAME_MAX bytes
+ */
+static void
+fmt_tname(char *buf)
+{
+#ifdef YOLOG_TLS
+    char *tname = Fmt_Tname;
+    if (tname[0]) {
+        memcpy(buf, tname, YOLOG_TNAME_MAX);
+        return;
+    }
+#else
+    char *tname = buf;
+#endif
+
+    tname[0] = '\0';
+#if defined(__linux__) && defined(_GNU_SOURCE)
+    pthread_getname_np(pthread_self(), tname, YOLOG_TNAME_MAX);
+    tname[YOLOG_TNAME_MAX-1] = '\0';
+#endif
+
+    if (!tname[0]) {
+        /* unnamed; use the thread ID */
+        char tmp[32], *p = tmp + sizeof(tmp);
+        unsigned long tid = fmt_tid();
+        *--p = '\0';
+        do {
+            *--p = '0' + (char)(tid % 10);
+            tid /= 10;
+        } while (tid && p > tmp);
+        strncpy(tname, p, YOLOG_TNAME_MAX-1);
+        tname[YOLOG_TNAME_MAX-1] = '\0';
+    }
+
+    if (tname != buf) {
+        memcpy(buf, tname, YOLOG_TNAME_MAX);
+    }
+}
+
 static
 const char *
 yolog_strlevel(yolog_level_t level)
@@ -65,6 +172,31 @@ yolog_strlevel(yolog_level_t level)
     return "";
 }
 
+/**
+ * Parses the ':s', ':ms', ':us' or ':ns' suffix of a time specifier into
+ * a number of fraction digits
+ */
+static int
+fmt_parse_frac(const char *opt, int dflt)
+{
+    const char *arg = strchr(opt, ':');
+    if (!arg) {
+        return dflt;
+    }
+    arg++;
+
+    if (strcmp(arg, "s") == 0) {
+        return 0;
+    } else if (strcmp(arg, "ms") == 0) {
+        return 3;
+    } else if (strcmp(arg, "us") == 0) {
+        return 6;
+    } else if (strcmp(arg, "ns") == 0) {
+        return 9;
+    }
+    return -1;
+}
+
 YOLOG_API
 struct yolog_fmt_st *
 yolog_fmt_compile(const char *fmtstr)
@@ -143,6 +275,22 @@ yolog_fmt_compile(const char *fmtstr)
             /* epoch */
             fmtcur->type = YOLOG_FMT_EPOCH;
 
+        } else if (optpos >= 3 && strncmp(optbuf, "tim", 3) == 0) {
+            /* wall clock time, ISO-8601 */
+            fmtcur->type = YOLOG_FMT_TIME;
+            fmtcur->arg = fmt_parse_frac(optbuf, 3);
+            if (fmtcur->arg < 0) {
+                goto GT_ERROR;
+            }
+
+        } else if (_cmpopt("mo")) {
+            /* monotonic clock */
+            fmtcur->type = YOLOG_FMT_MONO;
+            fmtcur->arg = fmt_parse_frac(optbuf, 6);
+            if (fmtcur->arg < 0) {
+                goto GT_ERROR;
+            }
+
         } else if (_cmpopt("pi")) {
             /* pid */
             fmtcur->type = YOLOG_FMT_PID;
@@ -151,6 +299,14 @@ yolog_fmt_compile(const char *fmtstr)
             /* tid */
             fmtcur->type = YOLOG_FMT_TID;
 
+        } else if (_cmpopt("tn")) {
+            /* thread name */
+            fmtcur->type = YOLOG_FMT_TNAME;
+
+        } else if (_cmpopt("se")) {
+            /* sequence number */
+            fmtcur->type = YOLOG_FMT_SEQ;
+
         } else if (_cmpopt("le")) {
             /* level */
             fmtcur->type = YOLOG_FMT_LVL;
@@ -191,71 +347,845 @@ yolog_fmt_compile(const char *fmtstr)
 }
 
 
+#ifdef __GNUC__
+__extension__ typedef long long fmt_llong;
+__extension__ typedef unsigned long long fmt_ullong;
+#else
+typedef long fmt_llong;
+typedef unsigned long fmt_ullong;
+#endif
+
+/**
+ * Writes the digits of v backwards, ending at 'end'. Returns the first digit.
+ */
+static char *
+fmt_utoa(char *end, fmt_ullong v, unsigned base, int upper)
+{
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    do {
+        *--end = digits[v % base];
+        v /= base;
+    } while (v);
+    return end;
+}
+
+static void
+fmt_append(char *buf, size_t nbuf, size_t *pos, const char *s, size_t n)
+{
+    if (n > nbuf - *pos) {
+        n = nbuf - *pos;
+    }
+    memcpy(buf + *pos, s, n);
+    *pos += n;
+}
+
+static void
+fmt_append_num(char *buf, size_t nbuf, size_t *pos, unsigned long v, int hex)
+{
+    char tmp[32];
+    char *p = fmt_utoa(tmp + sizeof(tmp), v, hex ? 16 : 10, 0);
+    if (hex) {
+        *--p = 'x';
+        *--p = '0';
+    }
+    fmt_append(buf, nbuf, pos, p, tmp + sizeof(tmp) - p);
+}
+
+/**
+ * Whether a field varies between messages of the same output, context and
+ * level
+ */
+#define fmt_is_dynamic(type) \
+    ((type) == YOLOG_FMT_EPOCH || (type) == YOLOG_FMT_PID || \
+     (type) == YOLOG_FMT_TID || (type) == YOLOG_FMT_FILENAME || \
+     (type) == YOLOG_FMT_LINE || (type) == YOLOG_FMT_FUNC || \
+     (type) == YOLOG_FMT_TIME || (type) == YOLOG_FMT_MONO || \
+     (type) == YOLOG_FMT_TNAME || (type) == YOLOG_FMT_SEQ)
+
+static void
+fmt_gettime(int monotonic, unsigned long *sec, unsigned long *nsec)
+{
+#ifdef __unix__
+    struct timespec ts;
+    if (yolog_tsc_time(0, monotonic, sec, nsec) == 0) {
+        return;
+    }
+    clock_gettime(monotonic ? CLOCK_MONOTONIC : CLOCK_REALTIME, &ts);
+    *sec = ts.tv_sec;
+    *nsec = ts.tv_nsec;
+#else
+    *sec = monotonic ? (unsigned long)clock() / CLOCKS_PER_SEC
+                     : (unsigned long)time(NULL);
+    *nsec = 0;
+#endif
+}
+
 void
-yolog_fmt_write(struct yolog_fmt_st *fmts,
-                FILE *fp,
-                const struct yolog_msginfo_st *minfo)
+yolog_msginfo_stamp(struct yolog_msginfo_st *minfo)
 {
-    struct yolog_fmt_st *fmtcur = fmts;
+    /* with the TSC clock, the times are worked out by the writer */
+    if (!yolog_tsc_stamp(minfo)) {
+        fmt_gettime(0, &minfo->m_time, &minfo->m_nsec);
+        fmt_gettime(1, &minfo->m_mono_sec, &minfo->m_mono_nsec);
+    }
+    minfo->m_tid = fmt_tid();
+    fmt_tname(minfo->m_tname);
+}
 
-    while (fmtcur->type != YOLOG_FMT_LISTEND) {
-        switch (fmtcur->type) {
-        case YOLOG_FMT_USTRING:
-            fprintf(fp, "%s", fmtcur->ustr);
-            goto GT_NOUSTR;
-            break;
+/**
+ * Appends '.' and the first 'digits' digits of a nanosecond count
+ */
+static void
+fmt_append_frac(char *buf, size_t nbuf, size_t *pos,
+                unsigned long nsec, int digits)
+{
+    char tmp[16];
+    int ii;
 
-        case YOLOG_FMT_EPOCH:
-            fprintf(fp, "%d", (int)time(NULL));
-            break;
+    if (digits <= 0) {
+        return;
+    }
 
-        case YOLOG_FMT_PID:
-            fprintf(fp, "%d", yolog_get_pid());
-            break;
+    for (ii = digits; ii < 9; ii++) {
+        nsec /= 10;
+    }
+    for (ii = digits; ii > 0; ii--) {
+        tmp[ii] = '0' + (char)(nsec % 10);
+        nsec /= 10;
+    }
+    tmp[0] = '.';
+    fmt_append(buf, nbuf, pos, tmp, digits + 1);
+}
+
+/**
+ * The date and time of day only change once a second, so each thread keeps
+ * the last one it rendered for %(time)
+ */
+struct fmt_datecache_st {
+    unsigned long sec;
+    size_t ndate;
+    char date[32];
+};
+
+#ifdef YOLOG_TLS
+static YOLOG_TLS struct fmt_datecache_st Fmt_Datecache;
+#endif
+
+static void
+fmt_append_time(char *buf, size_t nbuf, size_t *pos,
+                unsigned long sec, unsigned long nsec, int digits)
+{
+#ifdef YOLOG_TLS
+    struct fmt_datecache_st *dc = &Fmt_Datecache;
+#else
+    struct fmt_datecache_st dcbuf, *dc = &dcbuf;
+    dc->ndate = 0;
+#endif
+
+    if (dc->ndate == 0 || dc->sec != sec) {
+        time_t tt = (time_t)sec;
+        struct tm tm;
+#ifdef __unix__
+        localtime_r(&tt, &tm);
+#else
+        tm = *localtime(&tt);
+#endif
+        dc->ndate = strftime(dc->date, sizeof(dc->date),
+                             "%Y-%m-%dT%H:%M:%S", &tm);
+        dc->sec = sec;
+    }
+
+    fmt_append(buf, nbuf, pos, dc->date, dc->ndate);
+    fmt_append_frac(buf, nbuf, pos, nsec, digits);
+}
+
+static void
+fmt_render_field(int type,
+                 int arg,
+                 char *buf,
+                 size_t nbuf,
+                 size_t *ppos,
+                 const struct yolog_msginfo_st *minfo)
+{
+    size_t pos = *ppos;
+
+#define fmt_puts(s) fmt_append(buf, nbuf, &pos, s, strlen(s))
+#define fmt_putnum(v, hex) fmt_append_num(buf, nbuf, &pos, v, hex)
+
+    switch (type) {
+    case YOLOG_FMT_EPOCH:
+        fmt_putnum(minfo->m_time
+                   ? minfo->m_time : (unsigned long)time(NULL), 0);
+        break;
+
+    case YOLOG_FMT_PID: {
+        long pid = fmt_pid();
+        if (pid < 0) {
+            fmt_puts("-");
+            pid = -pid;
+        }
+        fmt_putnum((unsigned long)pid, 0);
+        break;
+    }
+
+    case YOLOG_FMT_TID:
+        fmt_putnum(minfo->m_tid ? minfo->m_tid : fmt_tid(),
+                   YOLOG_TID_HEX);
+        break;
+
+    case YOLOG_FMT_TNAME:
+        if (minfo->m_tid) {
+            /* captured by the logging thread */
+            fmt_puts(minfo->m_tname);
+        } else {
+            char tname[YOLOG_TNAME_MAX];
+            fmt_tname(tname);
+            fmt_puts(tname);
+        }
+        break;
+
+    case YOLOG_FMT_SEQ:
+        fmt_putnum(minfo->m_seq, 0);
+        break;
+
+    case YOLOG_FMT_LVL:
+        fmt_puts(yolog_strlevel(minfo->m_level));
+        break;
+
+    case YOLOG_FMT_TITLE:
+        fmt_puts(minfo->co_title);
+        fmt_puts(minfo->m_prefix);
+        fmt_puts(minfo->co_reset);
+        break;
+
+    case YOLOG_FMT_FILENAME:
+        fmt_puts(minfo->m_file);
+        break;
+
+    case YOLOG_FMT_LINE:
+        fmt_putnum((unsigned long)minfo->m_line, 0);
+        break;
+
+    case YOLOG_FMT_TIME:
+    case YOLOG_FMT_MONO: {
+        unsigned long sec, nsec;
+        int monotonic = (type == YOLOG_FMT_MONO);
+
+        if (monotonic && minfo->m_mono_sec) {
+            sec = minfo->m_mono_sec;
+            nsec = minfo->m_mono_nsec;
+        } else if (!monotonic && minfo->m_time) {
+            sec = minfo->m_time;
+            nsec = minfo->m_nsec;
+        } else {
+            fmt_gettime(monotonic, &sec, &nsec);
+        }
+
+        if (monotonic) {
+            fmt_putnum(sec, 0);
+            fmt_append_frac(buf, nbuf, &pos, nsec, arg);
+        } else {
+            fmt_append_time(buf, nbuf, &pos, sec, nsec, arg);
+        }
+        break;
+    }
+
+    case YOLOG_FMT_FUNC:
+        fmt_puts(minfo->m_func);
+        break;
+
+    case YOLOG_FMT_COLOR:
+        fmt_puts(minfo->co_line);
+        break;
+
+    default:
+        break;
+    }
+
+#undef fmt_puts
+#undef fmt_putnum
+
+    *ppos = pos;
+}
+
+size_t
+yolog_fmt_render(struct yolog_fmt_st *fmts,
+                 char *buf,
+                 size_t nbuf,
+                 const struct yolog_msginfo_st *minfo)
+{
+    struct yolog_fmt_st *fmtcur;
+    size_t pos = 0;
+
+    for (fmtcur = fmts; fmtcur->type != YOLOG_FMT_LISTEND; fmtcur++) {
+        fmt_render_field(fmtcur->type, fmtcur->arg, buf, nbuf, &pos, minfo);
+        fmt_append(buf, nbuf, &pos, fmtcur->ustr, strlen(fmtcur->ustr));
+    }
+
+    return pos;
+}
+
+struct yolog_hdrseg_st *
+yolog_fmt_precompile(struct yolog_fmt_st *fmts,
+                     const struct yolog_msginfo_st *minfo)
+{
+    struct yolog_fmt_st *fmtcur;
+    struct yolog_hdrseg_st *segs, *ret;
+    char text[YOLOG_LINE_MAX], *tcopy;
+    size_t nsegs = 1, ntext = 0, textpos = 0, ii = 0;
+
+    for (fmtcur = fmts; fmtcur->type != YOLOG_FMT_LISTEND; fmtcur++) {
+        if (fmt_is_dynamic(fmtcur->type)) {
+            nsegs++;
+        }
+    }
+
+    segs = malloc(sizeof(*segs) * nsegs);
+    if (!segs) {
+        return NULL;
+    }
+
+    for (fmtcur = fmts; fmtcur->type != YOLOG_FMT_LISTEND; fmtcur++) {
+        if (fmt_is_dynamic(fmtcur->type)) {
+            segs[ii].ntext = ntext - textpos;
+            segs[ii].type = fmtcur->type;
+            segs[ii].arg = fmtcur->arg;
+            textpos = ntext;
+            ii++;
+        } else {
+            fmt_render_field(fmtcur->type, fmtcur->arg,
+                             text, sizeof(text), &ntext, minfo);
+        }
+        fmt_append(text, sizeof(text), &ntext,
+                   fmtcur->ustr, strlen(fmtcur->ustr));
+    }
+
+    segs[ii].ntext = ntext - textpos;
+    segs[ii].type = YOLOG_FMT_LISTEND;
+    segs[ii].arg = 0;
+
+    /* the text lives right after the segments */
+    ret = malloc(sizeof(*segs) * nsegs + ntext);
+    if (ret) {
+        tcopy = (char *)(ret + nsegs);
+        memcpy(tcopy, text, ntext);
 
-        case YOLOG_FMT_TID:
-            yolog_fprintf_thread(fp);
+        for (ii = 0; ii < nsegs; ii++) {
+            ret[ii] = segs[ii];
+            ret[ii].text = tcopy;
+            tcopy += segs[ii].ntext;
+        }
+    }
+
+    free(segs);
+    return ret;
+}
+
+size_t
+yolog_hdr_render(const struct yolog_hdrseg_st *segs,
+                 char *buf,
+                 size_t nbuf,
+                 const struct yolog_msginfo_st *minfo)
+{
+    size_t pos = 0;
+
+    for (;; segs++) {
+        fmt_append(buf, nbuf, &pos, segs->text, segs->ntext);
+        if (segs->type == YOLOG_FMT_LISTEND) {
             break;
+        }
+        fmt_render_field(segs->type, segs->arg, buf, nbuf, &pos, minfo);
+    }
+
+    return pos;
+}
+
+unsigned long
+yolog_thread_id(void)
+{
+    return fmt_tid();
+}
+
+#ifndef va_copy
+#define YOLOG_VACOPY_OVERRIDE
+#ifdef __GNUC__
+#define va_copy __va_copy
+#else
+#define va_copy(dst, src) (dst) = (src)
+#endif /* __GNUC__ */
+#endif
+
+/* output state for yolog_vformat */
+struct fmt_out_st {
+    char *buf;
+    size_t nbuf;
+    size_t pos;
+};
+
+static void
+out_put(struct fmt_out_st *out, const char *s, size_t n)
+{
+    if (out->pos < out->nbuf) {
+        size_t room = out->nbuf - out->pos;
+        memcpy(out->buf + out->pos, s, n < room ? n : room);
+    }
+    out->pos += n;
+}
+
+static void
+out_pad(struct fmt_out_st *out, char c, long n)
+{
+    char pad[16];
+    memset(pad, c, sizeof(pad));
+    while (n > 0) {
+        size_t chunk = n < (long)sizeof(pad) ? (size_t)n : sizeof(pad);
+        out_put(out, pad, chunk);
+        n -= chunk;
+    }
+}
+
+/**
+ * Writes a field made of a prefix (sign or 0x), leading zeros and the
+ * digits, padded to width
+ */
+static void
+out_field(struct fmt_out_st *out,
+          const char *pfx, size_t npfx,
+          long nzeros,
+          const char *digits, size_t ndigits,
+          long width, int left)
+{
+    long total = npfx + nzeros + ndigits;
+
+    if (!left) {
+        out_pad(out, ' ', width - total);
+    }
+    out_put(out, pfx, npfx);
+    out_pad(out, '0', nzeros);
+    out_put(out, digits, ndigits);
+    if (left) {
+        out_pad(out, ' ', width - total);
+    }
+}
 
-        case YOLOG_FMT_LVL:
-            fprintf(fp, "%s", yolog_strlevel(minfo->m_level));
+static int
+fmt_signbit(double v)
+{
+    unsigned char bytes[sizeof(double)];
+    double one = 1;
+    unsigned char obytes[sizeof(double)];
+    size_t ii;
+
+    /* find the byte holding the sign, by comparing 1 with -1 */
+    memcpy(obytes, &one, sizeof(one));
+    one = -one;
+    memcpy(bytes, &one, sizeof(one));
+    for (ii = 0; ii < sizeof(double); ii++) {
+        if (bytes[ii] != obytes[ii]) {
             break;
+        }
+    }
+
+    memcpy(bytes, &v, sizeof(v));
+    return ii < sizeof(double) && (bytes[ii] & 0x80);
+}
+
+/* powers of ten for the fixed-point conversion of %f */
+static const double Fmt_Pow10[] = {
+    1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+/**
+ * Converts a double to fixed-point into 'tmp' (backwards, ending at 'end').
+ * Returns NULL if the value is too large or precise to convert exactly
+ * within the precision of a double.
+ */
+static char *
+fmt_dtoa(char *end, double v, int prec, int alt)
+{
+    fmt_ullong ipart, fpart;
+    double frac, rem;
+    char *p = end;
+    int ii;
 
-        case YOLOG_FMT_TITLE:
-            fprintf(fp, "%s%s%s",
-                    minfo->co_title, minfo->m_prefix, minfo->co_reset);
+    if (prec >= (int)(sizeof(Fmt_Pow10)/sizeof(Fmt_Pow10[0])) ||
+            v >= 1e15 / Fmt_Pow10[prec]) {
+        return NULL;
+    }
+
+    ipart = (fmt_ullong)v;
+    frac = (v - (double)ipart) * Fmt_Pow10[prec];
+    fpart = (fmt_ullong)frac;
+    rem = frac - (double)fpart;
+
+    if (rem > 0.5 - 1e-6 && rem < 0.5 + 1e-6) {
+        /**
+         * Too close to the midpoint to trust the multiplication. Settle
+         * exact ties (half to even, as printf does) and leave the rest to
+         * printf. The fraction is a tie iff it is a multiple of 2^-(prec+1),
+         * which can be checked exactly.
+         */
+        double g = (v - (double)ipart) * (double)(2UL << prec);
+        if (g != (double)(fmt_ullong)g) {
+            return NULL;
+        }
+        rem = ((prec ? fpart : ipart) & 1) ? 1 : 0;
+    }
+
+    if (rem > 0.5) {
+        fpart++;
+        if ((double)fpart >= Fmt_Pow10[prec]) {
+            fpart = 0;
+            ipart++;
+        }
+    }
+
+    if (prec) {
+        for (ii = 0; ii < prec; ii++) {
+            *--p = '0' + (char)(fpart % 10);
+            fpart /= 10;
+        }
+        *--p = '.';
+    } else if (alt) {
+        *--p = '.';
+    }
+
+    return fmt_utoa(p, ipart, 10, 0);
+}
+
+int
+yolog_vformat(char *buf, size_t nbuf, const char *fmt, va_list ap)
+{
+    struct fmt_out_st out;
+    const char *p = fmt;
+    va_list apsave;
+
+    out.buf = buf;
+    out.nbuf = nbuf ? nbuf - 1 : 0;
+    out.pos = 0;
+    va_copy(apsave, ap);
+
+    while (*p) {
+        const char *lit = p;
+        int left = 0, zero = 0, plus = 0, space = 0, alt = 0;
+        long width = 0, prec = -1;
+        int lmod = 0, conv;
+        fmt_ullong uval = 0;
+        int negative = 0;
+        unsigned base = 10;
+        char tmp[128], *digits, *end = tmp + sizeof(tmp);
+        char pfx[2];
+        size_t npfx = 0;
+
+        while (*p && *p != '%') {
+            p++;
+        }
+        out_put(&out, lit, p - lit);
+        if (!*p) {
             break;
+        }
+
+        p++;
 
-        case YOLOG_FMT_FILENAME:
-            fprintf(fp, "%s", minfo->m_file);
+        for (;; p++) {
+            if (*p == '-') {
+                left = 1;
+            } else if (*p == '0') {
+                zero = 1;
+            } else if (*p == '+') {
+                plus = 1;
+            } else if (*p == ' ') {
+                space = 1;
+            } else if (*p == '#') {
+                alt = 1;
+            } else {
+                break;
+            }
+        }
+
+        if (*p == '*') {
+            width = va_arg(ap, int);
+            if (width < 0) {
+                left = 1;
+                width = -width;
+            }
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9') {
+                width = width * 10 + (*p++ - '0');
+            }
+        }
+
+        if (*p == '.') {
+            p++;
+            prec = 0;
+            if (*p == '*') {
+                prec = va_arg(ap, int);
+                p++;
+            } else {
+                while (*p >= '0' && *p <= '9') {
+                    prec = prec * 10 + (*p++ - '0');
+                }
+            }
+        }
+
+        switch (*p) {
+        case 'h':
+            lmod = (p[1] == 'h') ? 'H' : 'h';
+            p += (lmod == 'H') ? 2 : 1;
+            break;
+        case 'l':
+            lmod = (p[1] == 'l') ? 'q' : 'l';
+            p += (lmod == 'q') ? 2 : 1;
+            break;
+        case 'q':
+        case 'j':
+            lmod = 'q';
+            p++;
             break;
+        case 'z':
+        case 't':
+            lmod = *p++;
+            break;
+        default:
+            break;
+        }
+
+        conv = *p++;
+
+        switch (conv) {
+        case '%':
+            out_put(&out, "%", 1);
+            continue;
 
-        case YOLOG_FMT_LINE:
-            fprintf(fp, "%d", minfo->m_line);
+        case 'd':
+        case 'i': {
+            fmt_llong sval;
+            if (lmod == 'l') {
+                sval = va_arg(ap, long);
+            } else if (lmod == 'q') {
+                sval = va_arg(ap, fmt_llong);
+            } else if (lmod == 'z') {
+                sval = (ptrdiff_t)va_arg(ap, size_t);
+            } else if (lmod == 't') {
+                sval = va_arg(ap, ptrdiff_t);
+            } else {
+                sval = va_arg(ap, int);
+                if (lmod == 'h') {
+                    sval = (short)sval;
+                } else if (lmod == 'H') {
+                    sval = (signed char)sval;
+                }
+            }
+            negative = sval < 0;
+            uval = negative ? -(fmt_ullong)sval : (fmt_ullong)sval;
             break;
+        }
 
-        case YOLOG_FMT_FUNC:
-            fprintf(fp, "%s", minfo->m_func);
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            if (lmod == 'l') {
+                uval = va_arg(ap, unsigned long);
+            } else if (lmod == 'q') {
+                uval = va_arg(ap, fmt_ullong);
+            } else if (lmod == 'z') {
+                uval = va_arg(ap, size_t);
+            } else if (lmod == 't') {
+                uval = (size_t)va_arg(ap, ptrdiff_t);
+            } else {
+                uval = va_arg(ap, unsigned int);
+                if (lmod == 'h') {
+                    uval = (unsigned short)uval;
+                } else if (lmod == 'H') {
+                    uval = (unsigned char)uval;
+                }
+            }
+            base = (conv == 'u') ? 10 : (conv == 'o') ? 8 : 16;
             break;
 
-        case YOLOG_FMT_COLOR:
-            fprintf(fp, "%s", minfo->co_line);
+        case 'p': {
+            void *ptr = va_arg(ap, void *);
+            if (!ptr) {
+                out_field(&out, NULL, 0, 0, "(nil)", 5, width, left);
+                continue;
+            }
+            uval = (size_t)ptr;
+            base = 16;
+            alt = 1;
             break;
+        }
+
+        case 'c':
+            if (lmod == 'l') {
+                goto GT_FALLBACK;
+            }
+            tmp[0] = (char)va_arg(ap, int);
+            out_field(&out, NULL, 0, 0, tmp, 1, width, left);
+            continue;
+
+        case 's': {
+            const char *str;
+            size_t slen = 0;
+
+            if (lmod == 'l') {
+                goto GT_FALLBACK;
+            }
+            str = va_arg(ap, const char *);
+            if (!str) {
+                str = (prec < 0 || prec >= 6) ? "(null)" : "";
+            }
+            while ((prec < 0 || (long)slen < prec) && str[slen]) {
+                slen++;
+            }
+            out_field(&out, NULL, 0, 0, str, slen, width, left);
+            continue;
+        }
+
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A': {
+            double dval;
+            const char *fdigits, *fend = end;
+
+            if (lmod == 'L') {
+                goto GT_FALLBACK;
+            }
+            dval = va_arg(ap, double);
+
+            if (conv == 'f' || conv == 'F') {
+                if (dval != dval) {
+                    negative = fmt_signbit(dval);
+                    fdigits = (conv == 'f') ? "nan" : "NAN";
+                    fend = fdigits + 3;
+                } else if (dval - dval != 0) {
+                    negative = dval < 0;
+                    fdigits = (conv == 'f') ? "inf" : "INF";
+                    fend = fdigits + 3;
+                } else {
+                    negative = fmt_signbit(dval);
+                    fdigits = fmt_dtoa(end, negative ? -dval : dval,
+                                       prec < 0 ? 6 : (int)prec, alt);
+                }
+            } else {
+                fdigits = NULL;
+            }
+
+            if (fdigits == NULL) {
+                /**
+                 * Out of range for our conversion. Let snprintf handle this
+                 * one, with the width and precision already resolved,
+                 * straight into what is left of the buffer.
+                 */
+                char sbuf[32], *sp = sbuf;
+                char *dst = out.pos < out.nbuf ? out.buf + out.pos : NULL;
+                size_t room = dst ? out.nbuf - out.pos + 1 : 0;
+                int rv;
+
+                *sp++ = '%';
+                if (left) { *sp++ = '-'; }
+                if (zero) { *sp++ = '0'; }
+                if (plus) { *sp++ = '+'; }
+                if (space) { *sp++ = ' '; }
+                if (alt) { *sp++ = '#'; }
+                *sp++ = '*';
+                if (prec >= 0) {
+                    *sp++ = '.';
+                    *sp++ = '*';
+                }
+                *sp++ = (char)conv;
+                *sp = '\0';
+
+                if (prec >= 0) {
+                    rv = snprintf(dst, room, sbuf,
+                                  (int)width, (int)prec, dval);
+                } else {
+                    rv = snprintf(dst, room, sbuf, (int)width, dval);
+                }
+                if (rv > 0) {
+                    out.pos += rv;
+                }
+                continue;
+            }
+
+            if (negative) {
+                pfx[npfx++] = '-';
+            } else if (plus) {
+                pfx[npfx++] = '+';
+            } else if (space) {
+                pfx[npfx++] = ' ';
+            }
+
+            out_field(&out, pfx, npfx,
+                      (zero && !left && fdigits[0] >= '0' && fdigits[0] <= '9')
+                      ? width - (long)(npfx + (fend - fdigits)) : 0,
+                      fdigits, fend - fdigits, width, left);
+            continue;
+        }
 
         default:
-            break;
+            /* %n, %m, positional arguments, long doubles.. */
+            goto GT_FALLBACK;
         }
 
-        if (fmtcur->ustr[0]) {
-            fprintf(fp, "%s", fmtcur->ustr);
+        /* integers */
+        if (prec == 0 && uval == 0) {
+            digits = end;
+        } else {
+            digits = fmt_utoa(end, uval, base, conv == 'X');
         }
 
-        GT_NOUSTR:
-        fmtcur++;
-        continue;
+        if (conv == 'd' || conv == 'i') {
+            if (negative) {
+                pfx[npfx++] = '-';
+            } else if (plus) {
+                pfx[npfx++] = '+';
+            } else if (space) {
+                pfx[npfx++] = ' ';
+            }
+        } else if (alt && base == 16 && uval) {
+            pfx[npfx++] = '0';
+            pfx[npfx++] = (conv == 'X') ? 'X' : 'x';
+        } else if (alt && base == 8 && (digits == end || *digits != '0')) {
+            *--digits = '0';
+        }
+
+        {
+            long ndigits = end - digits, nzeros = 0;
+            if (prec > ndigits) {
+                nzeros = prec - ndigits;
+            } else if (prec < 0 && zero && !left) {
+                nzeros = width - (long)npfx - ndigits;
+            }
+            out_field(&out, pfx, npfx, nzeros, digits, ndigits, width, left);
+        }
+    }
+
+    va_end(apsave);
+    if (nbuf) {
+        buf[out.pos < out.nbuf ? out.pos : out.nbuf] = '\0';
+    }
+    return (int)out.pos;
+
+    GT_FALLBACK:
+    {
+        int rv = vsnprintf(buf, nbuf, fmt, apsave);
+        va_end(apsave);
+        return rv;
     }
 }
 
+#ifdef YOLOG_VACOPY_OVERRIDE
+#undef va_copy
+#undef YOLOG_VACOPY_OVERRIDE
+#endif
+
 int
 yolog_set_fmtstr(struct yolog_output_st *output,
                  const char *fmt,
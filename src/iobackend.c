@@ -0,0 +1,601 @@
+/**
+ * Batched output for the asynchronous writer.
+ *
+ * Rather than writing each message through stdio, the writer appends the
+ * assembled lines for each output to a batch buffer, and hands all the
+ * filled buffers to an I/O backend at once whenever it has caught up (or a
+ * buffer fills). Each output has two buffers, so the writer carries on
+ * filling one while the other is being written.
+ *
+ * The io_uring backend queues a write for every output and submits them
+ * with a single system call, without waiting for them; completions are
+ * reaped before the buffers are reused. Where io_uring isn't available,
+ * the 'write' backend writes each buffer out synchronously, which is still
+ * one system call per output per batch rather than per message. The 'stdio'
+ * backend doesn't batch at all, and leaves everything to stdio as before.
+ *
+ * Outputs which need to know when each message reaches the file (those with
+ * a DurableLevel), or which don't write at all (memory mapped and binary
+ * outputs) are never batched.
+ */
+
+/* needed for syscall() and fileno in strict C89 builds */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
+#endif /* __unix__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "yolog.h"
+
+#ifdef __unix__
+#define YOLOG_IO_SUPPORTED
+#endif
+
+#ifdef YOLOG_IO_SUPPORTED
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(YOLOG_NO_IO_URING)
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define YOLOG_HAVE_IO_URING
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
+#endif /* __linux__ */
+
+/* most outputs batched by a single writer */
+#define YOLOG_IO_BATCH_MAX 32
+
+/* size of each of an output's two batch buffers */
+#define YOLOG_IO_BUFSIZE (64 * 1024)
+
+struct yolog_iobatch_st {
+    struct yolog_output_st *out;
+    char *buf[2];
+    size_t nbuf[2];
+
+    /* buffer being filled; the other one may be in flight */
+    int cur;
+    int inflight;
+
+    /* bytes of the in-flight buffer written so far */
+    size_t done;
+};
+
+struct yolog_iobackend_st {
+    const char *name;
+
+    /* returns 0 if the backend can be used */
+    int (*init)(struct yolog_io_st *io);
+
+    /* starts writing the in-flight buffers of 'batches' */
+    void (*submit)(struct yolog_io_st *io,
+                   struct yolog_iobatch_st **batches, int nbatches);
+
+    /* waits until everything submitted has been written */
+    void (*wait)(struct yolog_io_st *io);
+
+    void (*destroy)(struct yolog_io_st *io);
+};
+
+struct yolog_io_st {
+    const struct yolog_iobackend_st *backend;
+    void *impl;
+
+    struct yolog_iobatch_st batches[YOLOG_IO_BATCH_MAX];
+    int nbatches;
+
+    /* index of the batch last looked up */
+    int last;
+
+    /* number of batches in flight */
+    int inflight;
+};
+
+/**
+ * Writes whatever remains of a batch's in-flight buffer, and makes the
+ * buffer available again
+ */
+static void
+iob_finish(struct yolog_io_st *io, struct yolog_iobatch_st *batch)
+{
+    int ix = !batch->cur;
+    int fd = fileno(batch->out->fp);
+
+    while (batch->done < batch->nbuf[ix]) {
+        ssize_t rv = write(fd, batch->buf[ix] + batch->done,
+                           batch->nbuf[ix] - batch->done);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        batch->done += rv;
+    }
+
+    batch->nbuf[ix] = 0;
+    batch->done = 0;
+    batch->inflight = 0;
+    io->inflight--;
+}
+
+static int
+iob_write_init(struct yolog_io_st *io)
+{
+    (void)io;
+    return 0;
+}
+
+static void
+iob_write_submit(struct yolog_io_st *io,
+                 struct yolog_iobatch_st **batches, int nbatches)
+{
+    int ii;
+    for (ii = 0; ii < nbatches; ii++) {
+        iob_finish(io, batches[ii]);
+    }
+}
+
+static void
+iob_write_wait(struct yolog_io_st *io)
+{
+    (void)io;
+}
+
+static void
+iob_write_destroy(struct yolog_io_st *io)
+{
+    (void)io;
+}
+
+static const struct yolog_iobackend_st Yolog_IO_Write = {
+    "write",
+    iob_write_init,
+    iob_write_submit,
+    iob_write_wait,
+    iob_write_destroy
+};
+
+/* never batches anything */
+static const struct yolog_iobackend_st Yolog_IO_Stdio = {
+    "stdio",
+    iob_write_init,
+    iob_write_submit,
+    iob_write_wait,
+    iob_write_destroy
+};
+
+#ifdef YOLOG_HAVE_IO_URING
+
+#define iob_barrier() __sync_synchronize()
+
+struct iob_uring_st {
+    int fd;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+
+    volatile unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    volatile unsigned *cq_head;
+    volatile unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static int
+iob_uring_enter(int fd, unsigned nsubmit, unsigned nwait, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, nsubmit, nwait, flags, NULL, 0);
+}
+
+static void
+iob_uring_destroy(struct yolog_io_st *io)
+{
+    struct iob_uring_st *ur = io->impl;
+
+    if (!ur) {
+        return;
+    }
+
+    if (ur->sqes) {
+        munmap(ur->sqes, ur->sqes_size);
+    }
+    if (ur->cq_ring && ur->cq_ring != ur->sq_ring) {
+        munmap(ur->cq_ring, ur->cq_ring_size);
+    }
+    if (ur->sq_ring) {
+        munmap(ur->sq_ring, ur->sq_ring_size);
+    }
+    if (ur->fd != -1) {
+        close(ur->fd);
+    }
+    free(ur);
+    io->impl = NULL;
+}
+
+static int
+iob_uring_init(struct yolog_io_st *io)
+{
+    struct io_uring_params params;
+    struct iob_uring_st *ur;
+    char *sq, *cq;
+
+    ur = calloc(1, sizeof(*ur));
+    if (!ur) {
+        return -1;
+    }
+    io->impl = ur;
+
+    memset(&params, 0, sizeof(params));
+    ur->fd = syscall(__NR_io_uring_setup, YOLOG_IO_BATCH_MAX, &params);
+    if (ur->fd < 0) {
+        /* old kernel, or forbidden by a sandbox */
+        ur->fd = -1;
+        goto GT_ERROR;
+    }
+
+    /* writes at the current position (i.e. appending) need 5.6 */
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        goto GT_ERROR;
+    }
+
+    ur->sq_ring_size = params.sq_off.array +
+            params.sq_entries * sizeof(unsigned);
+    ur->cq_ring_size = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cq_ring_size > ur->sq_ring_size) {
+            ur->sq_ring_size = ur->cq_ring_size;
+        }
+        ur->cq_ring_size = ur->sq_ring_size;
+    }
+
+    ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if (ur->sq_ring == MAP_FAILED) {
+        ur->sq_ring = NULL;
+        goto GT_ERROR;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq_ring = ur->sq_ring;
+    } else {
+        ur->cq_ring = mmap(NULL, ur->cq_ring_size, PROT_READ|PROT_WRITE,
+                           MAP_SHARED|MAP_POPULATE, ur->fd,
+                           IORING_OFF_CQ_RING);
+        if (ur->cq_ring == MAP_FAILED) {
+            ur->cq_ring = NULL;
+            goto GT_ERROR;
+        }
+    }
+
+    ur->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED) {
+        ur->sqes = NULL;
+        goto GT_ERROR;
+    }
+
+    sq = ur->sq_ring;
+    cq = ur->cq_ring;
+    ur->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ur->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ur->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ur->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ur->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ur->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+
+    GT_ERROR:
+    iob_uring_destroy(io);
+    return -1;
+}
+
+/**
+ * Handles all the completions which have arrived so far
+ */
+static void
+iob_uring_reap(struct yolog_io_st *io)
+{
+    struct iob_uring_st *ur = io->impl;
+    unsigned head = *ur->cq_head;
+
+    iob_barrier();
+    while (head != *ur->cq_tail) {
+        struct io_uring_cqe *cqe = ur->cqes + (head & *ur->cq_mask);
+        struct yolog_iobatch_st *batch = io->batches + cqe->user_data;
+
+        if (cqe->res > 0) {
+            batch->done += cqe->res;
+        }
+
+        /* short or failed writes are finished off (or retried) directly */
+        iob_finish(io, batch);
+        head++;
+    }
+
+    iob_barrier();
+    *ur->cq_head = head;
+}
+
+static void
+iob_uring_wait(struct yolog_io_st *io)
+{
+    struct iob_uring_st *ur = io->impl;
+
+    iob_uring_reap(io);
+    while (io->inflight) {
+        if (iob_uring_enter(ur->fd, 0, io->inflight,
+                            IORING_ENTER_GETEVENTS) < 0 &&
+                errno != EINTR) {
+            break;
+        }
+        iob_uring_reap(io);
+    }
+}
+
+static void
+iob_uring_submit(struct yolog_io_st *io,
+                 struct yolog_iobatch_st **batches, int nbatches)
+{
+    struct iob_uring_st *ur = io->impl;
+    unsigned tail = *ur->sq_tail;
+    int ii, rv;
+
+    for (ii = 0; ii < nbatches; ii++) {
+        struct yolog_iobatch_st *batch = batches[ii];
+        unsigned ix = tail & *ur->sq_mask;
+        struct io_uring_sqe *sqe = ur->sqes + ix;
+        int bix = !batch->cur;
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fileno(batch->out->fp);
+        sqe->addr = (unsigned long)batch->buf[bix];
+        sqe->len = batch->nbuf[bix];
+        /* at the file position, which for O_APPEND is the end */
+        sqe->off = (__u64)-1;
+        sqe->user_data = batch - io->batches;
+
+        ur->sq_array[ix] = ix;
+        tail++;
+    }
+
+    iob_barrier();
+    *ur->sq_tail = tail;
+    iob_barrier();
+
+    do {
+        rv = iob_uring_enter(ur->fd, nbatches, 0, 0);
+    } while (rv < 0 && errno == EINTR);
+
+    if (rv < 0) {
+        /**
+         * The entries are still queued and would be submitted by the next
+         * call, so the ring can't be used any more. Write them out here.
+         */
+        fprintf(stderr, "Yolog: io_uring submission failed: %s\n",
+                strerror(errno));
+        io->backend = &Yolog_IO_Write;
+        for (ii = 0; ii < nbatches; ii++) {
+            iob_finish(io, batches[ii]);
+        }
+    }
+}
+
+static const struct yolog_iobackend_st Yolog_IO_Uring = {
+    "uring",
+    iob_uring_init,
+    iob_uring_submit,
+    iob_uring_wait,
+    iob_uring_destroy
+};
+
+#endif /* YOLOG_HAVE_IO_URING */
+
+struct yolog_io_st *
+yolog_io_create(const char *name)
+{
+    struct yolog_io_st *io = calloc(1, sizeof(*io));
+
+    if (!io) {
+        return NULL;
+    }
+
+    if (name && strcmp(name, "stdio") == 0) {
+        io->backend = &Yolog_IO_Stdio;
+        return io;
+    }
+
+#ifdef YOLOG_HAVE_IO_URING
+    if (!name || strcmp(name, "uring") == 0) {
+        io->backend = &Yolog_IO_Uring;
+        if (io->backend->init(io) == 0) {
+            return io;
+        }
+        if (name) {
+            fprintf(stderr, "Yolog: io_uring not available, "
+                    "using write()\n");
+        }
+    }
+#endif
+
+    io->backend = &Yolog_IO_Write;
+    io->backend->init(io);
+    return io;
+}
+
+void
+yolog_io_flush(struct yolog_io_st *io)
+{
+    struct yolog_iobatch_st *ready[YOLOG_IO_BATCH_MAX];
+    int ii, nready = 0;
+
+    if (io->inflight) {
+        io->backend->wait(io);
+    }
+
+    for (ii = 0; ii < io->nbatches; ii++) {
+        struct yolog_iobatch_st *batch = io->batches + ii;
+        if (!batch->nbuf[batch->cur]) {
+            continue;
+        }
+        batch->cur = !batch->cur;
+        batch->inflight = 1;
+        batch->done = 0;
+        ready[nready++] = batch;
+    }
+
+    if (nready) {
+        io->inflight += nready;
+        io->backend->submit(io, ready, nready);
+    }
+}
+
+void
+yolog_io_destroy(struct yolog_io_st *io)
+{
+    int ii;
+
+    if (!io) {
+        return;
+    }
+
+    yolog_io_flush(io);
+    if (io->inflight) {
+        io->backend->wait(io);
+    }
+    io->backend->destroy(io);
+
+    for (ii = 0; ii < io->nbatches; ii++) {
+        free(io->batches[ii].buf[0]);
+        free(io->batches[ii].buf[1]);
+    }
+    free(io);
+}
+
+struct yolog_iobatch_st *
+yolog_io_batch(struct yolog_io_st *io, struct yolog_output_st *out)
+{
+    struct yolog_iobatch_st *batch;
+    int ii;
+
+    if (!io || io->backend == &Yolog_IO_Stdio) {
+        return NULL;
+    }
+
+    if (io->nbatches && io->batches[io->last].out == out) {
+        return io->batches + io->last;
+    }
+
+    for (ii = 0; ii < io->nbatches; ii++) {
+        if (io->batches[ii].out == out) {
+            io->last = ii;
+            return io->batches + ii;
+        }
+    }
+
+    if (out->durable ||
+            (out->flags & (YOLOG_OUTPUT_F_MAPPED|YOLOG_OUTPUT_F_BINARY)) ||
+            io->nbatches == YOLOG_IO_BATCH_MAX) {
+        return NULL;
+    }
+
+    batch = io->batches + io->nbatches;
+    batch->buf[0] = malloc(YOLOG_IO_BUFSIZE);
+    batch->buf[1] = malloc(YOLOG_IO_BUFSIZE);
+    if (!batch->buf[0] || !batch->buf[1]) {
+        free(batch->buf[0]);
+        free(batch->buf[1]);
+        batch->buf[0] = batch->buf[1] = NULL;
+        return NULL;
+    }
+
+    /* anything already buffered by stdio goes first */
+    fflush(out->fp);
+    batch->out = out;
+    io->last = io->nbatches++;
+    return batch;
+}
+
+void
+yolog_io_append(struct yolog_io_st *io,
+                struct yolog_iobatch_st *batch,
+                const char *line, size_t nline,
+                const char *body, size_t nbody,
+                const char *tail, size_t ntail)
+{
+    char *buf;
+
+    if (batch->nbuf[batch->cur] + nline + nbody + ntail > YOLOG_IO_BUFSIZE) {
+        yolog_io_flush(io);
+    }
+
+    buf = batch->buf[batch->cur] + batch->nbuf[batch->cur];
+    memcpy(buf, line, nline);
+    if (nbody) {
+        memcpy(buf + nline, body, nbody);
+    }
+    if (ntail) {
+        memcpy(buf + nline + nbody, tail, ntail);
+    }
+    batch->nbuf[batch->cur] += nline + nbody + ntail;
+}
+
+#else
+
+struct yolog_io_st *
+yolog_io_create(const char *name)
+{
+    (void)name;
+    return NULL;
+}
+
+void
+yolog_io_flush(struct yolog_io_st *io)
+{
+    (void)io;
+}
+
+void
+yolog_io_destroy(struct yolog_io_st *io)
+{
+    (void)io;
+}
+
+struct yolog_iobatch_st *
+yolog_io_batch(struct yolog_io_st *io, struct yolog_output_st *out)
+{
+    (void)io; (void)out;
+    return NULL;
+}
+
+void
+yolog_io_append(struct yolog_io_st *io,
+                struct yolog_iobatch_st *batch,
+                const char *line, size_t nline,
+                const char *body, size_t nbody,
+                const char *tail, size_t ntail)
+{
+    (void)io; (void)batch; (void)line; (void)nline;
+    (void)body; (void)nbody; (void)tail; (void)ntail;
+}
+
+#endif /* YOLOG_IO_SUPPORTED */
@@ -0,0 +1,174 @@
+/**
+ * Per-call-site rate limiting and sampling.
+ *
+ * The generated _ratelimited and _sampled macros keep a small static
+ * structure at each call site, and ask one of the functions here whether
+ * the message may be logged before any of its arguments are evaluated.
+ *
+ * The rate limit is a token bucket kept as a single timestamp (the
+ * "generic cell rate algorithm"): 'next' is when the bucket will be full
+ * again, and a message is let through if that is no more than the burst
+ * ahead of now, advancing it by one interval. It is updated with a
+ * compare-and-swap, so call sites are never locked.
+ *
+ * The sampler lets one in N messages through, using a thread-local
+ * xorshift generator so that threads do not contend on its state.
+ *
+ * In both cases, the number of messages held back is counted, and logged
+ * just before the next message which is let through.
+ */
+
+/* needed for clock_gettime in strict C89 builds */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
+#endif /* __unix__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "yolog.h"
+
+#ifdef __GNUC__
+#define limit_cas(p, o, n) __sync_bool_compare_and_swap(p, o, n)
+#define limit_take(p) __sync_fetch_and_and(p, 0)
+#define limit_incr(p) __sync_fetch_and_add(p, 1)
+#else
+/* no atomics; counts may be off when threads race */
+#define limit_cas(p, o, n) (*(p) == (o) ? (*(p) = (n), 1) : 0)
+#define limit_take(p) limit_swap_zero(p)
+#define limit_incr(p) ((*(p))++)
+
+static unsigned long
+limit_swap_zero(volatile unsigned long *p)
+{
+    unsigned long v = *p;
+    *p = 0;
+    return v;
+}
+#endif /* __GNUC__ */
+
+#ifdef YOLOG_TLS
+static YOLOG_TLS unsigned long Limit_Prng;
+#else
+static unsigned long Limit_Prng;
+#endif
+
+static unsigned long
+limit_now_ms(void)
+{
+#if defined(__unix__) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    /* millisecond resolution is plenty, and this one is cheaper */
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0) {
+        return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    return (unsigned long)time(NULL) * 1000;
+#endif
+}
+
+static unsigned long
+limit_random(void)
+{
+    unsigned long x = Limit_Prng;
+
+    if (!x) {
+        /* different for each thread, and each run */
+        x = ((unsigned long)&x ^ (unsigned long)time(NULL) ^
+             limit_now_ms()) | 1;
+    }
+
+    /* xorshift32; only the low 32 bits are kept on 64 bit platforms */
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    Limit_Prng = x;
+    return x;
+}
+
+/**
+ * Logs how many messages were held back at the call site, if any
+ */
+static void
+limit_report(yolog_context *ctx,
+             struct yolog_limit_st *lim,
+             int level,
+             const char *file,
+             int line,
+             const char *fn,
+             const char *what)
+{
+    unsigned long held;
+
+    if (!lim->suppressed) {
+        return;
+    }
+
+    held = limit_take(&lim->suppressed);
+    if (held) {
+        yolog_logger(ctx, level, file, line, fn,
+                     "Yolog: %lu message(s) %s here since the last one",
+                     held, what);
+    }
+}
+
+YOLOG_API
+int
+yolog_ratelimit(yolog_context *ctx,
+                struct yolog_limit_st *lim,
+                int level,
+                const char *file,
+                int line,
+                const char *fn,
+                unsigned per_sec,
+                unsigned burst)
+{
+    unsigned long now, next, start, interval, allowance;
+
+    if (!per_sec) {
+        return 1;
+    }
+
+    interval = per_sec < 1000 ? 1000 / per_sec : 1;
+    allowance = burst > 1 ? interval * (burst - 1) : 0;
+    now = limit_now_ms();
+
+    do {
+        next = lim->next;
+        start = (long)(now - next) > 0 ? now : next;
+        if (start - now > allowance) {
+            limit_incr(&lim->suppressed);
+            return 0;
+        }
+    } while (!limit_cas(&lim->next, next, start + interval));
+
+    limit_report(ctx, lim, level, file, line, fn, "suppressed");
+    return 1;
+}
+
+YOLOG_API
+int
+yolog_sample(yolog_context *ctx,
+             struct yolog_limit_st *lim,
+             int level,
+             const char *file,
+             int line,
+             const char *fn,
+             unsigned one_in)
+{
+    if (one_in > 1 && limit_random() % one_in != 0) {
+        limit_incr(&lim->suppressed);
+        return 0;
+    }
+
+    limit_report(ctx, lim, level, file, line, fn, "not sampled");
+    return 1;
+}
@@ -0,0 +1,385 @@
+/**
+ * Memory mapped file outputs.
+ *
+ * The file is grown in large preallocated extents, each of which is mapped
+ * into a single range of address space reserved when the output is set up.
+ * Since the range never moves, a logging thread only has to reserve its
+ * bytes by advancing 'head' with an atomic add, and copy its line into the
+ * mapping; there are no system calls unless the line runs past the mapped
+ * extents, in which case the next extent is allocated under a mutex.
+ *
+ * The file is left with trailing zeroes from the last extent until it is
+ * truncated to 'head' at exit, when the output is rotated, or when it is
+ * pointed at another file. These take the lock exclusively, which is how
+ * they wait for copies in progress; logging threads only ever take it
+ * shared, which doesn't need a system call.
+ */
+
+/* needed for fallocate, pwrite and MAP_ANONYMOUS in strict C89 builds */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
+#endif /* __unix__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "yolog.h"
+
+#if defined(__unix__) && defined(__GNUC__)
+#define YOLOG_MAPPED_SUPPORTED
+#endif
+
+#ifdef YOLOG_MAPPED_SUPPORTED
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/**
+ * Address space reserved for each output. Lines which would land beyond it
+ * are written with pwrite() instead.
+ */
+#ifndef YOLOG_MAPPED_RESERVE
+#define YOLOG_MAPPED_RESERVE \
+    (sizeof(void*) >= 8 ? ((size_t)1 << 36) : ((size_t)1 << 28))
+#endif
+
+/* default size of each preallocated extent */
+#define YOLOG_MAPPED_EXTENT_DEFAULT (8 * 1024 * 1024)
+
+struct yolog_mapped_st {
+    int fd;
+
+    /* reserved address range, and how much of it is backed by the file */
+    char *base;
+    volatile size_t mapped;
+    size_t extent;
+
+    /* next byte to be reserved; the length of the file once all is copied */
+    volatile size_t head;
+
+    /* taken shared while copying, exclusively to truncate or swap files */
+    pthread_rwlock_t lock;
+
+    /* serializes growing the mapping */
+    pthread_mutex_t grow;
+
+    struct yolog_mapped_st *next;
+};
+
+/* all mapped outputs, so they can be truncated at exit */
+static struct yolog_mapped_st *Yolog_Mapped_List;
+static pthread_mutex_t Yolog_Mapped_Mutex = PTHREAD_MUTEX_INITIALIZER;
+static int Yolog_Mapped_Atexit;
+
+static int
+mapped_allocate(int fd, size_t offset, size_t len)
+{
+#ifdef __linux__
+    if (fallocate(fd, 0, offset, len) == 0) {
+        return 0;
+    }
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+        return -1;
+    }
+#endif
+    /* sparse, but at least the mapping is backed */
+    return ftruncate(fd, offset + len);
+}
+
+/**
+ * Makes sure [0, end) is mapped. Returns -1 if it cannot be.
+ */
+static int
+mapped_grow(struct yolog_mapped_st *mm, size_t end)
+{
+    int rv = 0;
+
+    if (end > YOLOG_MAPPED_RESERVE) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mm->grow);
+    while (mm->mapped < end) {
+        size_t len = mm->extent;
+        void *addr;
+
+        if (mm->mapped + len > YOLOG_MAPPED_RESERVE) {
+            len = YOLOG_MAPPED_RESERVE - mm->mapped;
+        }
+
+        if (mapped_allocate(mm->fd, mm->mapped, len) != 0) {
+            rv = -1;
+            break;
+        }
+
+        addr = mmap(mm->base + mm->mapped, len, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_FIXED, mm->fd, mm->mapped);
+        if (addr == MAP_FAILED) {
+            rv = -1;
+            break;
+        }
+
+        __sync_synchronize();
+        mm->mapped += len;
+    }
+    pthread_mutex_unlock(&mm->grow);
+    return rv;
+}
+
+static void
+mapped_put(struct yolog_mapped_st *mm, size_t offset,
+           const char *buf, size_t nbuf)
+{
+    if (offset + nbuf <= mm->mapped ||
+            mapped_grow(mm, offset + nbuf) == 0) {
+        memcpy(mm->base + offset, buf, nbuf);
+        return;
+    }
+
+    /* out of address space (or disk); fall back to the descriptor */
+    while (nbuf) {
+        ssize_t rv = pwrite(mm->fd, buf, nbuf, offset);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += rv;
+        nbuf -= rv;
+        offset += rv;
+    }
+}
+
+/**
+ * Cuts the file down to what has been written and drops the mapping, keeping
+ * the address range reserved. Called with the lock held exclusively.
+ */
+static void
+mapped_finish(struct yolog_mapped_st *mm)
+{
+    if (mm->fd == -1) {
+        return;
+    }
+
+    if (mm->mapped) {
+        mmap(mm->base, mm->mapped, PROT_NONE,
+             MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED, -1, 0);
+        mm->mapped = 0;
+    }
+
+    if (ftruncate(mm->fd, mm->head) != 0) {
+        fprintf(stderr, "Yolog: Couldn't truncate mapped output: %s\n",
+                strerror(errno));
+    }
+}
+
+static void
+mapped_atexit(void)
+{
+    struct yolog_mapped_st *mm;
+
+    /* anything still queued is written before the files are finished */
+    yolog_async_drain_all();
+
+    pthread_mutex_lock(&Yolog_Mapped_Mutex);
+    for (mm = Yolog_Mapped_List; mm; mm = mm->next) {
+        pthread_rwlock_wrlock(&mm->lock);
+        mapped_finish(mm);
+        mm->fd = -1;
+        pthread_rwlock_unlock(&mm->lock);
+    }
+    pthread_mutex_unlock(&Yolog_Mapped_Mutex);
+}
+
+/**
+ * Starts writing at the end of the output's current file. Outputs are opened
+ * for appending only, which can neither be mapped for writing nor written
+ * at an offset, so the file is reopened for reading and writing in place of
+ * the original descriptor.
+ */
+static int
+mapped_attach(struct yolog_mapped_st *mm, struct yolog_output_st *out)
+{
+    struct stat sb;
+    int fd;
+
+    if (!out->path) {
+        return -1;
+    }
+
+    fd = open(out->path, O_RDWR);
+    if (fd == -1) {
+        return -1;
+    }
+
+    fflush(out->fp);
+    mm->fd = fileno(out->fp);
+    dup2(fd, mm->fd);
+    close(fd);
+
+    mm->head = 0;
+    if (fstat(mm->fd, &sb) == 0) {
+        mm->head = sb.st_size;
+    }
+    return 0;
+}
+
+int
+yolog_mapped_init(struct yolog_output_st *out, size_t extent)
+{
+    struct yolog_mapped_st *mm;
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    if (!extent) {
+        extent = YOLOG_MAPPED_EXTENT_DEFAULT;
+    }
+    if (pagesize > 0) {
+        extent = (extent + pagesize - 1) / pagesize * pagesize;
+    }
+
+    if (out->mapped) {
+        /* the output may have been pointed at another file */
+        mm = out->mapped;
+        pthread_rwlock_wrlock(&mm->lock);
+        if (mm->fd != fileno(out->fp)) {
+            mapped_finish(mm);
+            if (mapped_attach(mm, out) != 0) {
+                mm->fd = -1;
+                pthread_rwlock_unlock(&mm->lock);
+                out->flags &= ~YOLOG_OUTPUT_F_MAPPED;
+                return -1;
+            }
+        }
+        mm->extent = extent;
+        pthread_rwlock_unlock(&mm->lock);
+        out->flags |= YOLOG_OUTPUT_F_MAPPED;
+        return 0;
+    }
+
+    mm = calloc(1, sizeof(*mm));
+    if (!mm) {
+        return -1;
+    }
+
+    mm->base = mmap(NULL, YOLOG_MAPPED_RESERVE, PROT_NONE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (mm->base == MAP_FAILED) {
+        free(mm);
+        return -1;
+    }
+
+    if (mapped_attach(mm, out) != 0) {
+        munmap(mm->base, YOLOG_MAPPED_RESERVE);
+        free(mm);
+        return -1;
+    }
+
+    mm->extent = extent;
+    pthread_rwlock_init(&mm->lock, NULL);
+    pthread_mutex_init(&mm->grow, NULL);
+
+    pthread_mutex_lock(&Yolog_Mapped_Mutex);
+    mm->next = Yolog_Mapped_List;
+    Yolog_Mapped_List = mm;
+    if (!Yolog_Mapped_Atexit) {
+        atexit(mapped_atexit);
+        Yolog_Mapped_Atexit = 1;
+    }
+    pthread_mutex_unlock(&Yolog_Mapped_Mutex);
+
+    out->mapped = mm;
+    out->flags |= YOLOG_OUTPUT_F_MAPPED;
+    return 0;
+}
+
+void
+yolog_mapped_write(struct yolog_output_st *out,
+                   const char *line, size_t nline,
+                   const char *body, size_t nbody,
+                   const char *tail, size_t ntail)
+{
+    struct yolog_mapped_st *mm = out->mapped;
+    size_t offset;
+
+    pthread_rwlock_rdlock(&mm->lock);
+    if (mm->fd == -1) {
+        /* finished at exit */
+        pthread_rwlock_unlock(&mm->lock);
+        return;
+    }
+
+    offset = __sync_fetch_and_add(&mm->head, nline + nbody + ntail);
+    mapped_put(mm, offset, line, nline);
+    if (nbody) {
+        mapped_put(mm, offset + nline, body, nbody);
+    }
+    if (ntail) {
+        mapped_put(mm, offset + nline + nbody, tail, ntail);
+    }
+    pthread_rwlock_unlock(&mm->lock);
+}
+
+void
+yolog_mapped_swap(struct yolog_output_st *out, int fd,
+                  const char *mark, size_t nmark)
+{
+    struct yolog_mapped_st *mm = out->mapped;
+
+    pthread_rwlock_wrlock(&mm->lock);
+    if (mm->fd != -1) {
+        mapped_finish(mm);
+        if (out->durable) {
+            /* what was marked durable went to the old file */
+            fdatasync(mm->fd);
+        }
+        dup2(fd, mm->fd);
+        mm->head = 0;
+        mapped_put(mm, 0, mark, nmark);
+        mm->head = nmark;
+    }
+    pthread_rwlock_unlock(&mm->lock);
+}
+
+#else
+
+int
+yolog_mapped_init(struct yolog_output_st *out, size_t extent)
+{
+    (void)out; (void)extent;
+    return -1;
+}
+
+void
+yolog_mapped_write(struct yolog_output_st *out,
+                   const char *line, size_t nline,
+                   const char *body, size_t nbody,
+                   const char *tail, size_t ntail)
+{
+    (void)out; (void)line; (void)nline;
+    (void)body; (void)nbody; (void)tail; (void)ntail;
+}
+
+void
+yolog_mapped_swap(struct yolog_output_st *out, int fd,
+                  const char *mark, size_t nmark)
+{
+    (void)out; (void)fd; (void)mark; (void)nmark;
+}
+
+#endif /* YOLOG_MAPPED_SUPPORTED */
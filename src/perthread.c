@@ -0,0 +1,225 @@
+/**
+ * Per-thread files.
+ *
+ * A per-thread output keeps a pthread key whose value, in each thread, is
+ * the stream for that thread's own file (path.<tid>), opened the first time
+ * the thread logs to it. Writing to it needs no lock, since nothing else
+ * writes to it; the stream is closed (and flushed) when the thread exits,
+ * and at process exit along with all other streams.
+ *
+ * The file gets the buffering of the output, with messages at or above its
+ * FlushLevel flushed right away. FlushInterval is not applied, as the
+ * flusher thread cannot safely touch another thread's stream.
+ */
+
+/* needed for clock_gettime and fwrite_unlocked in strict C89 builds */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
+#endif /* __unix__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "yolog.h"
+
+#if defined(__unix__) && defined(__GNUC__)
+#define YOLOG_PERTHREAD_SUPPORTED
+#endif
+
+#ifdef YOLOG_PERTHREAD_SUPPORTED
+#include <pthread.h>
+#include <time.h>
+
+#ifdef __GLIBC__
+#define perthread_fwrite fwrite_unlocked
+#else
+#define perthread_fwrite fwrite
+#endif
+
+struct yolog_perthread_st {
+    pthread_key_t key;
+};
+
+/* stored in place of the stream when a thread's file couldn't be opened */
+static char Perthread_Failed;
+
+static void
+perthread_close(void *arg)
+{
+    if (arg != &Perthread_Failed) {
+        fclose((FILE*)arg);
+    }
+}
+
+static FILE *
+perthread_open(struct yolog_output_st *out)
+{
+    struct yolog_perthread_st *pt = out->perthread;
+    char *path;
+    FILE *fp;
+
+    path = malloc(strlen(out->path) + 32);
+    if (!path) {
+        return NULL;
+    }
+    sprintf(path, "%s.%lu", out->path, yolog_thread_id());
+
+    fp = fopen(path, "a");
+    if (!fp) {
+        fprintf(stderr, "Yolog: Couldn't open per-thread output '%s': %s\n",
+                path, strerror(errno));
+        free(path);
+        pthread_setspecific(pt->key, &Perthread_Failed);
+        return NULL;
+    }
+    free(path);
+
+    switch (out->buffering) {
+    case YOLOG_BUFFER_NONE:
+        setvbuf(fp, NULL, _IONBF, 0);
+        break;
+    case YOLOG_BUFFER_LINE:
+        setvbuf(fp, NULL, _IOLBF, BUFSIZ);
+        break;
+    default:
+        /* DEFAULT is flushed after every message */
+        break;
+    }
+
+    pthread_setspecific(pt->key, fp);
+    return fp;
+}
+
+/**
+ * Formats the merge key into buf, which must hold at least 64 bytes
+ */
+static size_t
+perthread_key(char *buf, const struct yolog_msginfo_st *minfo)
+{
+    char tmp[24], *p;
+    unsigned long nsec = minfo->m_nsec;
+    size_t pos = 0;
+    int ii;
+
+#define perthread_putnum(n) do { \
+    unsigned long v__ = (n); \
+    p = tmp + sizeof(tmp); \
+    do { \
+        *--p = '0' + (char)(v__ % 10); \
+        v__ /= 10; \
+    } while (v__); \
+    memcpy(buf + pos, p, tmp + sizeof(tmp) - p); \
+    pos += tmp + sizeof(tmp) - p; \
+} while (0)
+
+    perthread_putnum(minfo->m_time);
+    buf[pos++] = '.';
+    for (ii = 8; ii >= 0; ii--) {
+        buf[pos + ii] = '0' + (char)(nsec % 10);
+        nsec /= 10;
+    }
+    pos += 9;
+    buf[pos++] = ' ';
+    perthread_putnum(minfo->m_seq);
+    buf[pos++] = ' ';
+
+#undef perthread_putnum
+    return pos;
+}
+
+int
+yolog_perthread_init(struct yolog_output_st *out)
+{
+    struct yolog_perthread_st *pt;
+
+    if (!out->path) {
+        return -1;
+    }
+
+    if (out->perthread) {
+        out->flags |= YOLOG_OUTPUT_F_PERTHREAD;
+        return 0;
+    }
+
+    pt = calloc(1, sizeof(*pt));
+    if (!pt) {
+        return -1;
+    }
+
+    if (pthread_key_create(&pt->key, perthread_close) != 0) {
+        free(pt);
+        return -1;
+    }
+
+    out->perthread = pt;
+    out->flags |= YOLOG_OUTPUT_F_PERTHREAD;
+    return 0;
+}
+
+void
+yolog_perthread_write(struct yolog_output_st *out,
+                      const struct yolog_msginfo_st *minfo,
+                      const char *line, size_t nline,
+                      const char *body, size_t nbody)
+{
+    FILE *fp = pthread_getspecific(out->perthread->key);
+    char key[64];
+    size_t nkey;
+
+    if (!fp) {
+        fp = perthread_open(out);
+    }
+
+    if (!fp || fp == (FILE*)&Perthread_Failed) {
+        /* no file of its own; fall back to the shared one */
+        flockfile(out->fp);
+        fwrite(line, 1, nline, out->fp);
+        if (body) {
+            fwrite(body, 1, nbody, out->fp);
+            fputs(minfo->co_reset, out->fp);
+            putc('\n', out->fp);
+        }
+        funlockfile(out->fp);
+        return;
+    }
+
+    nkey = perthread_key(key, minfo);
+    perthread_fwrite(key, 1, nkey, fp);
+    perthread_fwrite(line, 1, nline, fp);
+    if (body) {
+        perthread_fwrite(body, 1, nbody, fp);
+        perthread_fwrite(minfo->co_reset, 1, strlen(minfo->co_reset), fp);
+        perthread_fwrite("\n", 1, 1, fp);
+    }
+
+    if (out->buffering == YOLOG_BUFFER_DEFAULT ||
+            (out->buffering != YOLOG_BUFFER_NONE &&
+                    minfo->m_level >= out->flush_level)) {
+        fflush(fp);
+    }
+}
+
+#else
+
+int
+yolog_perthread_init(struct yolog_output_st *out)
+{
+    (void)out;
+    return -1;
+}
+
+void
+yolog_perthread_write(struct yolog_output_st *out,
+                      const struct yolog_msginfo_st *minfo,
+                      const char *line, size_t nline,
+                      const char *body, size_t nbody)
+{
+    (void)out; (void)minfo; (void)line; (void)nline;
+    (void)body; (void)nbody;
+}
+
+#endif /* YOLOG_PERTHREAD_SUPPORTED */
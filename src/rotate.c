@@ -0,0 +1,357 @@
+/**
+ * Rotation of file outputs.
+ *
+ * Each rotating output has a thread of its own which does all the work.
+ * Logging threads only count the bytes they write, and wake the thread up
+ * once the output has grown past its MaxSize; time based rotation is driven
+ * by the thread's own timer.
+ *
+ * To rotate, the thread renames the existing segments out of the way, opens
+ * a fresh file and dup2()s it over the output's descriptor. The FILE (and
+ * the descriptor number used by AtomicWrite outputs) stay the same, so
+ * there is nothing for logging threads to reload; a write() either lands in
+ * the old file or in the new one. The output is only locked for the flush
+ * of its stdio buffer and the dup2() itself.
+ *
+ * The segment which was just rotated out is then compressed by running
+ * gzip from the (low priority) rotation thread.
+ */
+
+/* needed for fdatasync, posix_spawn and strdup in strict C89 builds */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
+#endif /* __unix__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "yolog.h"
+
+#if defined(__unix__) && defined(__GNUC__)
+#define YOLOG_ROTATE_SUPPORTED
+#endif
+
+#ifdef YOLOG_ROTATE_SUPPORTED
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+extern char **environ;
+
+/* longest path of a rotated segment, including the suffix */
+#define ROTATE_PATH_MAX 4096
+
+struct yolog_rotate_st {
+    struct yolog_output_st *out;
+    char *path;
+
+    /* rotate once this many bytes have been written, 0 for no limit */
+    unsigned long max_size;
+
+    /* rotate this often (seconds), 0 for never */
+    unsigned long every;
+
+    /* number of old segments kept */
+    int keep;
+
+    /* whether old segments are compressed */
+    int compress;
+
+    /* bytes written to the current file */
+    volatile unsigned long written;
+
+    /* set (once) by the logging thread which crosses max_size */
+    volatile int pending;
+
+    time_t opened;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void
+rotate_segname(char *buf, const char *path, int ix, int gz)
+{
+    sprintf(buf, "%s.%d%s", path, ix, gz ? ".gz" : "");
+}
+
+static int
+rotate_exists(const char *path)
+{
+    struct stat sb;
+    return stat(path, &sb) == 0;
+}
+
+/**
+ * Moves segment 'ix' (compressed or not) to 'ix + 1', or removes it if
+ * there is no room for it
+ */
+static void
+rotate_shift(struct yolog_rotate_st *rot, const char *path, int ix)
+{
+    char from[ROTATE_PATH_MAX], to[ROTATE_PATH_MAX];
+    int gz;
+
+    for (gz = 0; gz < 2; gz++) {
+        rotate_segname(from, path, ix, gz);
+        if (!rotate_exists(from)) {
+            continue;
+        }
+
+        if (ix >= rot->keep) {
+            unlink(from);
+        } else {
+            rotate_segname(to, path, ix + 1, gz);
+            rename(from, to);
+        }
+    }
+}
+
+static void
+rotate_compress(const char *segment)
+{
+    char *argv[5];
+    pid_t pid;
+    int status;
+
+    argv[0] = "gzip";
+    argv[1] = "-f";
+    argv[2] = "--";
+    argv[3] = (char *)segment;
+    argv[4] = NULL;
+
+    if (posix_spawnp(&pid, "gzip", NULL, NULL, argv, environ) != 0) {
+        fprintf(stderr, "Yolog: Couldn't run gzip on '%s'\n", segment);
+        return;
+    }
+
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        ;
+    }
+}
+
+static void
+rotate_now(struct yolog_rotate_st *rot, const char *path)
+{
+    struct yolog_output_st *out = rot->out;
+    char segment[ROTATE_PATH_MAX];
+    char mark[64];
+    int ii, fd;
+
+    for (ii = rot->keep; ii > 0; ii--) {
+        rotate_shift(rot, path, ii);
+    }
+
+    rotate_segname(segment, path, 1, 0);
+    if (rot->keep > 0) {
+        rename(path, segment);
+    } else {
+        unlink(path);
+    }
+
+    if (out->flags & YOLOG_OUTPUT_F_MAPPED) {
+        /* mapped files are written at an offset */
+        fd = open(path, O_RDWR|O_CREAT, 0666);
+    } else {
+        fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0666);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "Yolog: Couldn't reopen '%s': %s\n",
+                path, strerror(errno));
+        /* keep writing to the renamed file */
+        rot->written = 0;
+        return;
+    }
+
+    sprintf(mark, "--- Mark at %lu ---\n", (unsigned long)time(NULL));
+
+    if (out->flags & YOLOG_OUTPUT_F_MAPPED) {
+        /* the old file is cut down to what was actually written */
+        yolog_mapped_swap(out, fd, mark, strlen(mark));
+
+    } else {
+        flockfile(out->fp);
+        fflush(out->fp);
+        if (out->durable) {
+            /* what was marked durable went to the old file */
+            fdatasync(fileno(out->fp));
+        }
+        dup2(fd, fileno(out->fp));
+        fputs(mark, out->fp);
+        if (out->flags & YOLOG_OUTPUT_F_BINARY) {
+            /* the new file needs its own header and call site definitions */
+            yolog_binlog_init(out);
+        }
+        fflush(out->fp);
+        funlockfile(out->fp);
+    }
+
+    rot->written = 0;
+    rot->pending = 0;
+
+    close(fd);
+    rot->opened = time(NULL);
+
+    if (rot->compress && rot->keep > 0) {
+        rotate_compress(segment);
+    }
+}
+
+static void *
+rotate_main(void *arg)
+{
+    struct yolog_rotate_st *rot = arg;
+    char path[ROTATE_PATH_MAX];
+
+#ifdef __linux__
+    /* on Linux the nice value is per-thread, and inherited by gzip */
+    setpriority(PRIO_PROCESS, (id_t)yolog_thread_id(), 19);
+#endif
+
+    pthread_mutex_lock(&rot->mutex);
+    for (;;) {
+        while (!rot->pending) {
+            if (rot->every) {
+                struct timespec ts;
+                ts.tv_sec = rot->opened + rot->every;
+                ts.tv_nsec = 0;
+                if (time(NULL) >= ts.tv_sec) {
+                    break;
+                }
+                pthread_cond_timedwait(&rot->cond, &rot->mutex, &ts);
+            } else {
+                pthread_cond_wait(&rot->cond, &rot->mutex);
+            }
+        }
+
+        /* the output may be pointed elsewhere by a reloaded config */
+        strcpy(path, rot->path);
+        pthread_mutex_unlock(&rot->mutex);
+        rotate_now(rot, path);
+        pthread_mutex_lock(&rot->mutex);
+    }
+    return NULL;
+}
+
+int
+yolog_rotate_init(struct yolog_output_st *out,
+                  unsigned long max_size,
+                  unsigned long every,
+                  int keep,
+                  int compress)
+{
+    struct yolog_rotate_st *rot;
+    struct stat sb;
+    pthread_t thr;
+    pthread_attr_t attr;
+
+    if (out->path && strlen(out->path) + 16 > ROTATE_PATH_MAX) {
+        return -1;
+    }
+
+    if (out->rotate) {
+        /* already rotating; only the policy (and perhaps file) changes */
+        rot = out->rotate;
+        pthread_mutex_lock(&rot->mutex);
+        if (out->path && strcmp(out->path, rot->path) != 0) {
+            free(rot->path);
+            rot->path = strdup(out->path);
+            rot->opened = time(NULL);
+            rot->written = 0;
+            if (fstat(fileno(out->fp), &sb) == 0) {
+                rot->written = sb.st_size;
+            }
+        }
+        rot->max_size = max_size;
+        rot->every = every;
+        rot->keep = keep;
+        rot->compress = compress;
+        pthread_cond_signal(&rot->cond);
+        pthread_mutex_unlock(&rot->mutex);
+        return 0;
+    }
+
+    if (!out->path) {
+        return -1;
+    }
+
+    rot = calloc(1, sizeof(*rot));
+    if (!rot) {
+        return -1;
+    }
+
+    rot->out = out;
+    rot->path = strdup(out->path);
+    rot->max_size = max_size;
+    rot->every = every;
+    rot->keep = keep;
+    rot->compress = compress;
+    rot->opened = time(NULL);
+
+    if (fstat(fileno(out->fp), &sb) == 0) {
+        rot->written = sb.st_size;
+    }
+
+    pthread_mutex_init(&rot->mutex, NULL);
+    pthread_cond_init(&rot->cond, NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thr, &attr, rotate_main, rot) != 0) {
+        pthread_attr_destroy(&attr);
+        pthread_cond_destroy(&rot->cond);
+        pthread_mutex_destroy(&rot->mutex);
+        free(rot->path);
+        free(rot);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    out->rotate = rot;
+    return 0;
+}
+
+void
+yolog_rotate_account(struct yolog_output_st *out, size_t nbytes)
+{
+    struct yolog_rotate_st *rot = out->rotate;
+    unsigned long written = __sync_add_and_fetch(&rot->written, nbytes);
+
+    if (rot->max_size && written >= rot->max_size && !rot->pending &&
+            __sync_bool_compare_and_swap(&rot->pending, 0, 1)) {
+        pthread_mutex_lock(&rot->mutex);
+        pthread_cond_signal(&rot->cond);
+        pthread_mutex_unlock(&rot->mutex);
+    }
+}
+
+#else
+
+int
+yolog_rotate_init(struct yolog_output_st *out,
+                  unsigned long max_size,
+                  unsigned long every,
+                  int keep,
+                  int compress)
+{
+    (void)out; (void)max_size; (void)every; (void)keep; (void)compress;
+    return -1;
+}
+
+void
+yolog_rotate_account(struct yolog_output_st *out, size_t nbytes)
+{
+    (void)out; (void)nbytes;
+}
+
+#endif /* YOLOG_ROTATE_SUPPORTED */
@@ -0,0 +1,268 @@
+/**
+ * Timestamps from the CPU's time stamp counter.
+ *
+ * With the TSC clock in use, a message is stamped with a single rdtsc
+ * rather than calls to clock_gettime(), and the counter is turned into
+ * wall clock and monotonic time only when the message is written (by the
+ * asynchronous writer, if there is one).
+ *
+ * The conversion is calibrated against the system clocks: the rate of the
+ * counter is measured against CLOCK_MONOTONIC over the whole time since the
+ * clock was enabled, so it gets more precise as time goes on, while the
+ * offset is taken afresh from CLOCK_REALTIME (and CLOCK_MONOTONIC) whenever
+ * the calibration is more than YOLOG_TSC_RECALIBRATE_MS old. Whichever
+ * thread converts a timestamp first after that does the recalibration;
+ * readers pick up the new values through a generation count, without a lock.
+ *
+ * This is only available on x86-64 with an invariant TSC, i.e. one which
+ * ticks at a constant rate on all cores regardless of power states.
+ */
+
+/* needed for clock_gettime and nanosleep in strict C89 builds */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
+#endif /* __unix__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "yolog.h"
+
+#if defined(__unix__) && defined(__GNUC__) && defined(__x86_64__)
+#define YOLOG_TSC_SUPPORTED
+#endif
+
+#ifdef YOLOG_TSC_SUPPORTED
+#include <time.h>
+#include <cpuid.h>
+
+#define tsc_barrier() __sync_synchronize()
+
+/* how long the first calibration measures the counter for */
+#define TSC_CALIBRATE_NS 5000000L
+
+struct tsc_calib_st {
+    /* counter value, and the time (ns) it corresponds to on both clocks */
+    unsigned long tsc;
+    unsigned long real_ns;
+    unsigned long mono_ns;
+
+    /* nanoseconds per tick, as 32.32 fixed point */
+    unsigned long mult;
+};
+
+static volatile int Tsc_Enabled;
+
+/* the current calibration is Tsc_Calib[Tsc_Gen & 1] */
+static struct tsc_calib_st Tsc_Calib[2];
+static volatile unsigned Tsc_Gen;
+static volatile int Tsc_Busy;
+
+/* where the rate is measured from */
+static unsigned long Tsc_First;
+static unsigned long Tsc_First_Mono;
+
+/* recalibrate after this many ticks */
+static unsigned long Tsc_Interval;
+
+static unsigned long
+tsc_read(void)
+{
+    return __builtin_ia32_rdtsc();
+}
+
+static unsigned long
+tsc_clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int
+tsc_invariant(void)
+{
+    unsigned eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) ||
+            eax < 0x80000007) {
+        return 0;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx >> 8) & 1;
+}
+
+/**
+ * Takes a new calibration point, and publishes it
+ */
+static void
+tsc_calibrate(void)
+{
+    struct tsc_calib_st *next = Tsc_Calib + ((Tsc_Gen + 1) & 1);
+    unsigned long tsc, mono;
+
+    /* the counter is read between the two clocks, to split the difference */
+    next->real_ns = tsc_clock_ns(CLOCK_REALTIME);
+    tsc = tsc_read();
+    mono = tsc_clock_ns(CLOCK_MONOTONIC);
+
+    next->tsc = tsc;
+    next->mono_ns = mono;
+    next->mult = (unsigned long)((double)(mono - Tsc_First_Mono) *
+                                 4294967296.0 / (double)(tsc - Tsc_First));
+
+    tsc_barrier();
+    Tsc_Gen++;
+}
+
+/**
+ * Scales a tick count to nanoseconds, without overflowing for large counts
+ */
+static unsigned long
+tsc_scale(unsigned long ticks, unsigned long mult)
+{
+    return (ticks >> 32) * mult + (((ticks & 0xffffffffUL) * mult) >> 32);
+}
+
+int
+yolog_tsc_time(unsigned long tsc, int monotonic,
+               unsigned long *sec, unsigned long *nsec)
+{
+    struct tsc_calib_st calib;
+    unsigned gen;
+    unsigned long ns;
+
+    if (!Tsc_Enabled) {
+        return -1;
+    }
+
+    if (!tsc) {
+        tsc = tsc_read();
+    }
+
+    do {
+        gen = Tsc_Gen;
+        tsc_barrier();
+        calib = Tsc_Calib[gen & 1];
+        tsc_barrier();
+    } while (gen != Tsc_Gen);
+
+    if (tsc - calib.tsc > Tsc_Interval && (long)(tsc - calib.tsc) > 0 &&
+            __sync_bool_compare_and_swap(&Tsc_Busy, 0, 1)) {
+        tsc_calibrate();
+        Tsc_Busy = 0;
+    }
+
+    ns = monotonic ? calib.mono_ns : calib.real_ns;
+    if ((long)(tsc - calib.tsc) >= 0) {
+        ns += tsc_scale(tsc - calib.tsc, calib.mult);
+    } else {
+        /* stamped before the calibration was taken */
+        ns -= tsc_scale(calib.tsc - tsc, calib.mult);
+    }
+
+    *sec = ns / 1000000000UL;
+    *nsec = ns % 1000000000UL;
+    return 0;
+}
+
+int
+yolog_tsc_stamp(struct yolog_msginfo_st *minfo)
+{
+    if (!Tsc_Enabled) {
+        return 0;
+    }
+    minfo->m_tsc = tsc_read();
+    return 1;
+}
+
+void
+yolog_tsc_resolve(struct yolog_msginfo_st *minfo)
+{
+    if (!minfo->m_tsc || minfo->m_time) {
+        return;
+    }
+    if (yolog_tsc_time(minfo->m_tsc, 0, &minfo->m_time, &minfo->m_nsec) == 0) {
+        yolog_tsc_time(minfo->m_tsc, 1,
+                       &minfo->m_mono_sec, &minfo->m_mono_nsec);
+    }
+    minfo->m_tsc = 0;
+}
+
+YOLOG_API
+int
+yolog_set_clock(int clock)
+{
+    struct timespec delay;
+    unsigned long elapsed;
+
+    if (clock != YOLOG_CLOCK_TSC) {
+        Tsc_Enabled = 0;
+        return 0;
+    }
+
+    if (Tsc_Enabled) {
+        return 0;
+    }
+
+    if (!tsc_invariant()) {
+        return -1;
+    }
+
+    /* measure the rate over a short while to begin with */
+    Tsc_First_Mono = tsc_clock_ns(CLOCK_MONOTONIC);
+    Tsc_First = tsc_read();
+
+    delay.tv_sec = 0;
+    delay.tv_nsec = TSC_CALIBRATE_NS;
+    nanosleep(&delay, NULL);
+
+    tsc_calibrate();
+    elapsed = Tsc_Calib[Tsc_Gen & 1].tsc - Tsc_First;
+    if (!elapsed) {
+        return -1;
+    }
+
+    Tsc_Interval = (unsigned long)((double)elapsed *
+            (YOLOG_TSC_RECALIBRATE_MS * 1000000.0) /
+            (double)(Tsc_Calib[Tsc_Gen & 1].mono_ns - Tsc_First_Mono));
+
+    tsc_barrier();
+    Tsc_Enabled = 1;
+    return 0;
+}
+
+#else
+
+int
+yolog_tsc_time(unsigned long tsc, int monotonic,
+               unsigned long *sec, unsigned long *nsec)
+{
+    (void)tsc; (void)monotonic; (void)sec; (void)nsec;
+    return -1;
+}
+
+int
+yolog_tsc_stamp(struct yolog_msginfo_st *minfo)
+{
+    (void)minfo;
+    return 0;
+}
+
+void
+yolog_tsc_resolve(struct yolog_msginfo_st *minfo)
+{
+    (void)minfo;
+}
+
+YOLOG_API
+int
+yolog_set_clock(int clock)
+{
+    return clock == YOLOG_CLOCK_TSC ? -1 : 0;
+}
+
+#endif /* YOLOG_TSC_SUPPORTED */
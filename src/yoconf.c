@@ -1,3 +1,10 @@
+/* needed for fileno in strict C89 builds */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
+#endif /* __unix__ */
+
 #include "yolog.h"
 #include <errno.h>
 #include <stdlib.h>
@@ -12,6 +19,24 @@
 #define strcasecmp _stricmp
 #endif
 
+#if defined(__unix__) && defined(__GNUC__)
+#include <pthread.h>
+
+/**
+ * Level changes come from the configuration and, while shedding load, from
+ * the asynchronous writer; they are made one at a time. The new omasks are
+ * published before the level which lets messages through to them.
+ */
+static pthread_mutex_t Yoconf_Levels_Mutex = PTHREAD_MUTEX_INITIALIZER;
+#define yoconf_levels_lock() pthread_mutex_lock(&Yoconf_Levels_Mutex)
+#define yoconf_levels_unlock() pthread_mutex_unlock(&Yoconf_Levels_Mutex)
+#define yoconf_publish() __sync_synchronize()
+#else
+#define yoconf_levels_lock()
+#define yoconf_levels_unlock()
+#define yoconf_publish()
+#endif
+
 #ifndef ATTR_UNUSED
 #ifdef __GNUC__
 #define ATTR_UNUSED __attribute__((unused))
@@ -64,15 +89,87 @@ yolog_level_by_name(const char *lvlstr)
 void
 yolog_sync_levels(yolog_context *ctx)
 {
-    int ii;
-    int minlevel = 0xff;
+    int ii, lvl;
+    int minlevel = YOLOG_LEVEL_MAX;
+    struct yolog_output_st *outputs[YOLOG_OUTPUT_COUNT];
+    unsigned char omasks[YOLOG_LEVEL_MAX];
+
+    memset(omasks, 0, sizeof(omasks));
+
+    yoconf_levels_lock();
+
+    if (!ctx->parent) {
+        /* not initialized; let the logging functions decide */
+        memset(ctx->omasks, 0, sizeof(ctx->omasks));
+        ctx->level = YOLOG_LEVEL_UNSET;
+        yolog_sync_headers(ctx);
+        yoconf_levels_unlock();
+        return;
+    }
+
+    outputs[YOLOG_OUTPUT_SCREEN] = &ctx->parent->o_screen;
+    outputs[YOLOG_OUTPUT_GFILE] = &ctx->parent->o_file;
+    outputs[YOLOG_OUTPUT_PFILE] = ctx->o_alt;
+
     for (ii = 0; ii < YOLOG_OUTPUT_COUNT; ii++) {
-        if (ctx->olevels[ii] < minlevel) {
-            minlevel = ctx->olevels[ii];
+        int olevel;
+
+        if (outputs[ii] == NULL || outputs[ii]->fp == NULL) {
+            continue;
+        }
+
+        olevel = ctx->olevels[ii];
+        if (olevel == YOLOG_LEVEL_UNSET) {
+            olevel = outputs[ii]->level;
         }
+
+        if (olevel == YOLOG_LEVEL_UNSET) {
+            continue;
+        }
+
+        if (olevel < minlevel) {
+            minlevel = olevel;
+        }
+
+        for (lvl = olevel; lvl < YOLOG_LEVEL_MAX; lvl++) {
+            omasks[lvl] |= 1 << ii;
+        }
+    }
+
+    memcpy(ctx->omasks, omasks, sizeof(omasks));
+    yoconf_publish();
+    ctx->level = minlevel < ctx->shed ? ctx->shed : minlevel;
+    yoconf_publish();
+    yolog_sync_headers(ctx);
+    yoconf_levels_unlock();
+}
+
+void
+yolog_set_shed(yolog_context *ctx, int shed)
+{
+    int lvl;
+
+    yoconf_levels_lock();
+
+    /* the outputs themselves accept from the lowest level with a mask */
+    for (lvl = 0; lvl < YOLOG_LEVEL_MAX && !ctx->omasks[lvl]; lvl++) {
+        ;
     }
-    if (minlevel != 0xff) {
-        ctx->level = minlevel;
+
+    ctx->shed = shed;
+    yoconf_publish();
+    ctx->level = lvl < shed ? shed : lvl;
+    yoconf_publish();
+
+    yoconf_levels_unlock();
+}
+
+void
+yolog_sync_group(yolog_context_group *grp)
+{
+    int ii;
+    for (ii = 0; ii < grp->ncontexts; ii++) {
+        yolog_sync_levels(grp->contexts + ii);
     }
 }
 
@@ -195,6 +292,338 @@ open_new_file(const char *path, const char *mode)
     return fp;
 }
 
+/**
+ * Options common to all file and screen outputs
+ */
+static void
+handle_buffering(struct apesq_section_st *sec,
+                 struct yolog_output_st *out,
+                 int is_file,
+                 int binary)
+{
+    struct apesq_value_st *apval;
+    int bufsize = 0, interval = 0, mode;
+
+    out->buffering = YOLOG_BUFFER_DEFAULT;
+    out->flush_level = YOLOG_ERROR;
+    out->flush_interval = 0;
+    out->dirty = 0;
+
+    if ( (apval = apesq_get_values(sec, "Buffering")) == NULL) {
+        if (binary) {
+            /* binary records are only worth it with buffering */
+            out->buffering = YOLOG_BUFFER_BLOCK;
+        }
+        goto GT_FLUSH_OPTIONS;
+    }
+
+    if (!is_file) {
+        fprintf(stderr, "Yolog: Buffering is only valid for file outputs\n");
+        return;
+    }
+
+    if (strcasecmp(apval->strdata, "none") == 0) {
+        out->buffering = YOLOG_BUFFER_NONE;
+        mode = _IONBF;
+    } else if (strcasecmp(apval->strdata, "line") == 0) {
+        out->buffering = YOLOG_BUFFER_LINE;
+        mode = _IOLBF;
+    } else if (strcasecmp(apval->strdata, "block") == 0) {
+        out->buffering = YOLOG_BUFFER_BLOCK;
+        mode = _IOFBF;
+    } else {
+        fprintf(stderr, "Yolog: Unrecognized Buffering '%s'\n",
+                apval->strdata);
+        return;
+    }
+
+    apesq_read_value(sec, "BufferSize", APESQ_T_INT, 0, &bufsize);
+    if (bufsize < 0) {
+        bufsize = 0;
+    }
+
+    /* nothing but the mark line has been written yet */
+    fflush(out->fp);
+    setvbuf(out->fp, NULL, mode, bufsize ? (size_t)bufsize : BUFSIZ);
+
+    GT_FLUSH_OPTIONS:
+    if ( (apval = apesq_get_values(sec, "FlushLevel"))) {
+        int level = yolog_level_by_name(apval->strdata);
+        if (level == -1) {
+            fprintf(stderr, "Yolog: Unrecognized level '%s'\n",
+                    apval->strdata);
+        } else {
+            out->flush_level = level;
+        }
+    }
+
+    apesq_read_value(sec, "FlushInterval", APESQ_T_INT, 0, &interval);
+    if (interval > 0 && out->buffering != YOLOG_BUFFER_DEFAULT) {
+        out->flush_interval = interval;
+        if (yolog_flusher_add(out) != 0) {
+            fprintf(stderr, "Yolog: Couldn't set up FlushInterval\n");
+        }
+    }
+}
+
+static void
+handle_durability(struct apesq_section_st *sec,
+                  struct yolog_output_st *out,
+                  int is_file)
+{
+    struct apesq_value_st *apval;
+    int level, wait = 0;
+
+    if ( (apval = apesq_get_values(sec, "DurableLevel")) == NULL) {
+        if (out->durable) {
+            /* turn it off, but keep the thread around */
+            yolog_durable_init(out, YOLOG_LEVEL_MAX, 0);
+        }
+        return;
+    }
+
+    if (!is_file) {
+        fprintf(stderr, "Yolog: DurableLevel is only valid for files\n");
+        return;
+    }
+
+    level = yolog_level_by_name(apval->strdata);
+    if (level == -1) {
+        fprintf(stderr, "Yolog: Unrecognized level '%s'\n", apval->strdata);
+        return;
+    }
+
+    apesq_read_value(sec, "DurableWait", APESQ_T_BOOL, 0, &wait);
+    if (yolog_durable_init(out, level, wait) != 0) {
+        fprintf(stderr, "Yolog: Couldn't set up DurableLevel\n");
+    }
+}
+
+/**
+ * Reads a number with an optional suffix; 'mults' holds the multiplier
+ * for each character in 'suffixes'. Returns 0 if the value isn't valid.
+ */
+static unsigned long
+read_scaled(const char *str, const char *suffixes, const unsigned long *mults)
+{
+    char *end;
+    const char *sfx;
+    unsigned long val = strtoul(str, &end, 10);
+
+    if (end == str) {
+        return 0;
+    }
+
+    while (isspace(*end)) {
+        end++;
+    }
+
+    if (*end == '\0') {
+        return val;
+    }
+
+    if (end[1] == '\0' && (sfx = strchr(suffixes, tolower(*end))) != NULL) {
+        return val * mults[sfx - suffixes];
+    }
+
+    return 0;
+}
+
+/* multipliers for the k, M and G suffixes of sizes */
+static const unsigned long size_mults[] = {
+    1024UL, 1024UL * 1024, 1024UL * 1024 * 1024
+};
+
+static void
+handle_rotation(struct apesq_section_st *sec,
+                struct yolog_output_st *out,
+                int is_file)
+{
+    static const unsigned long time_mults[] = { 1, 60, 3600, 86400 };
+
+    struct apesq_value_st *apval;
+    unsigned long max_size = 0, every = 0;
+    int keep = 5, compress = 0;
+
+    if ( (apval = apesq_get_values(sec, "MaxSize"))) {
+        max_size = read_scaled(apval->strdata, "kmg", size_mults);
+        if (!max_size) {
+            fprintf(stderr, "Yolog: Invalid MaxSize '%s'\n", apval->strdata);
+        }
+    }
+
+    if ( (apval = apesq_get_values(sec, "RotateEvery"))) {
+        every = read_scaled(apval->strdata, "smhd", time_mults);
+        if (!every) {
+            fprintf(stderr, "Yolog: Invalid RotateEvery '%s'\n",
+                    apval->strdata);
+        }
+    }
+
+    if (!max_size && !every) {
+        if (out->rotate) {
+            /* turn it off, but keep the thread around */
+            yolog_rotate_init(out, 0, 0, 0, 0);
+        }
+        return;
+    }
+
+    if (!is_file) {
+        fprintf(stderr, "Yolog: Rotation is only valid for file outputs\n");
+        return;
+    }
+
+    apesq_read_value(sec, "Keep", APESQ_T_INT, 0, &keep);
+    if (keep < 0) {
+        keep = 0;
+    }
+    apesq_read_value(sec, "Compress", APESQ_T_BOOL, 0, &compress);
+
+    if (yolog_rotate_init(out, max_size, every, keep, compress) != 0) {
+        fprintf(stderr, "Yolog: Couldn't set up rotation\n");
+    }
+}
+
+static void
+handle_mapping(struct apesq_section_st *sec,
+               struct yolog_output_st *out,
+               int is_file,
+               int binary)
+{
+    struct apesq_value_st *apval;
+    unsigned long extent = 0;
+    int mapped = 0;
+
+    apesq_read_value(sec, "MemoryMap", APESQ_T_BOOL, 0, &mapped);
+    if (!mapped) {
+        out->flags &= ~YOLOG_OUTPUT_F_MAPPED;
+        return;
+    }
+
+    if (!is_file || binary) {
+        fprintf(stderr, "Yolog: MemoryMap is only valid for text files\n");
+        return;
+    }
+
+    if ( (apval = apesq_get_values(sec, "MapExtent"))) {
+        extent = read_scaled(apval->strdata, "kmg", size_mults);
+        if (!extent) {
+            fprintf(stderr, "Yolog: Invalid MapExtent '%s'\n",
+                    apval->strdata);
+        }
+    }
+
+    if (yolog_mapped_init(out, extent) != 0) {
+        fprintf(stderr, "Yolog: Couldn't set up MemoryMap\n");
+    }
+}
+
+static void
+handle_dedup(struct apesq_section_st *sec,
+             struct yolog_output_st *out,
+             int binary)
+{
+    int dedup = 0, timeout = 0;
+
+    apesq_read_value(sec, "Deduplicate", APESQ_T_BOOL, 0, &dedup);
+    if (!dedup) {
+        /* pending repeats are still reported by the timer */
+        out->flags &= ~YOLOG_OUTPUT_F_DEDUP;
+        return;
+    }
+
+    if (binary) {
+        fprintf(stderr, "Yolog: Deduplicate is only valid for text outputs\n");
+        return;
+    }
+
+    apesq_read_value(sec, "DedupTimeout", APESQ_T_INT, 0, &timeout);
+    if (timeout < 0) {
+        timeout = 0;
+    }
+
+    if (yolog_dedup_init(out, timeout) != 0) {
+        fprintf(stderr, "Yolog: Couldn't set up Deduplicate\n");
+    }
+}
+
+static void
+handle_perthread(struct apesq_section_st *sec,
+                 struct yolog_output_st *out,
+                 int is_file,
+                 int binary)
+{
+    int perthread = 0;
+
+    apesq_read_value(sec, "PerThread", APESQ_T_BOOL, 0, &perthread);
+    if (!perthread) {
+        /* files already open stay so until their threads exit */
+        out->flags &= ~YOLOG_OUTPUT_F_PERTHREAD;
+        return;
+    }
+
+    if (!is_file || binary) {
+        fprintf(stderr, "Yolog: PerThread is only valid for text files\n");
+        return;
+    }
+
+    if (out->flags & (YOLOG_OUTPUT_F_MAPPED|YOLOG_OUTPUT_F_DEDUP)) {
+        fprintf(stderr, "Yolog: PerThread can't be combined with "
+                "MemoryMap or Deduplicate\n");
+        return;
+    }
+
+    if (yolog_perthread_init(out) != 0) {
+        fprintf(stderr, "Yolog: Couldn't set up PerThread\n");
+    }
+}
+
+static void
+handle_output_options(struct apesq_section_st *sec,
+                      struct yolog_output_st *out,
+                      int is_file)
+{
+    int atomic = 0, binary = 0;
+
+    apesq_read_value(sec, "Binary", APESQ_T_BOOL, 0, &binary);
+    if (binary && !is_file) {
+        fprintf(stderr, "Yolog: Binary is only valid for file outputs\n");
+
+    } else if (binary) {
+        if (yolog_binlog_init(out) != 0) {
+            fprintf(stderr, "Yolog: Couldn't set up binary output\n");
+        }
+
+    } else {
+        out->flags &= ~YOLOG_OUTPUT_F_BINARY;
+    }
+
+    handle_buffering(sec, out, is_file, binary);
+    handle_durability(sec, out, is_file);
+    handle_rotation(sec, out, is_file);
+    handle_mapping(sec, out, is_file, binary);
+    handle_dedup(sec, out, binary);
+    handle_perthread(sec, out, is_file, binary);
+
+    apesq_read_value(sec, "AtomicWrite", APESQ_T_BOOL, 0, &atomic);
+    if (atomic && (binary || (out->flags & YOLOG_OUTPUT_F_MAPPED))) {
+        /* these don't go through the text path which does the write(2) */
+        fprintf(stderr, "Yolog: AtomicWrite can't be combined with "
+                "Binary or MemoryMap\n");
+        out->flags &= ~YOLOG_OUTPUT_F_ATOMIC;
+    } else if (atomic) {
+#ifdef __unix__
+        fflush(out->fp);
+        out->fd = fileno(out->fp);
+        out->flags |= YOLOG_OUTPUT_F_ATOMIC;
+#else
+        fprintf(stderr, "Yolog: AtomicWrite not supported\n");
+#endif
+    } else {
+        out->flags &= ~YOLOG_OUTPUT_F_ATOMIC;
+    }
+}
+
 static void
 handle_subsys_output(
         yolog_context *ctx,
@@ -234,6 +663,7 @@ handle_subsys_output(
             } else {
                 FILE *fp;
                 char *fname;
+                char fpath[16384] = { 0 };
                 olix = YOLOG_OUTPUT_PFILE;
 
                 if ((*onames)[0] == '/' || *logroot == '\0') {
@@ -241,7 +671,6 @@ handle_subsys_output(
                     fp = open_new_file(*onames, "a");
 
                 } else {
-                    char fpath[16384] = { 0 };
                     assert (*logroot);
 
                     fname = fpath;
@@ -269,13 +698,17 @@ handle_subsys_output(
                 assert (ctx->o_alt == NULL);
                 ctx->o_alt = calloc(1, sizeof(*ctx->o_alt));
                 ctx->o_alt->fp = fp;
+                ctx->o_alt->path = strdup(fname);
 
                 if ( (apval = apesq_get_values(osec, "Format"))) {
                     ctx->o_alt->fmtv = yolog_fmt_compile(apval->strdata);
 
-                } else {
+                } else if (fmtdef) {
                     ctx->o_alt->fmtv = fmtdef;
                     *fmtdef_used = 1;
+
+                } else {
+                    ctx->o_alt->fmtv = yolog_fmt_compile(YOLOG_FORMAT_DEFAULT);
                 }
             }
 
@@ -294,12 +727,132 @@ handle_subsys_output(
 
                 apesq_read_value(osec, "Color", APESQ_T_BOOL, 0,
                                  &ctx->o_alt->use_color);
+                handle_output_options(osec, ctx->o_alt, 1);
             }
         }
     }
     free (oents);
 }
 
+static void
+handle_async(yolog_context_group *grp, struct apesq_entry_st *root)
+{
+    struct apesq_entry_st **secents = apesq_get_sections(root, "Async");
+    struct apesq_section_st *sec;
+    struct apesq_value_st *apval;
+    const char *backend = NULL;
+    int enabled = 1, nslots = 0;
+    int overflow = YOLOG_OVERFLOW_BLOCK, timeout = 0, level = YOLOG_LEVEL_MAX;
+    int prio_level = YOLOG_ERROR, prio_window = YOLOG_ASYNC_PRIO_WINDOW;
+    int shed_depth = 0, shed_lag = 0, percpu = 0, order_window = 0;
+
+    if (!secents) {
+        return;
+    }
+
+    /* only the first section is considered */
+    sec = APESQ_SECTION(*secents);
+    free (secents);
+
+    apesq_read_value(sec, "Enabled", APESQ_T_BOOL, 0, &enabled);
+    if (!enabled) {
+        return;
+    }
+
+    if (apesq_get_values(sec, "QueueSize") &&
+            (apesq_read_value(sec, "QueueSize", APESQ_T_INT, 0, &nslots)
+                    != APESQ_VALUE_OK || nslots < 0)) {
+        fprintf(stderr, "Yolog: Bad QueueSize for Async section\n");
+        nslots = 0;
+    }
+
+    if ( (apval = apesq_get_values(sec, "Backend"))) {
+        if (strcasecmp(apval->strdata, "uring") == 0) {
+            backend = "uring";
+        } else if (strcasecmp(apval->strdata, "write") == 0) {
+            backend = "write";
+        } else if (strcasecmp(apval->strdata, "stdio") == 0) {
+            backend = "stdio";
+        } else if (strcasecmp(apval->strdata, "auto") != 0) {
+            fprintf(stderr, "Yolog: Unrecognized Backend '%s'\n",
+                    apval->strdata);
+        }
+    }
+
+    apesq_read_value(sec, "PerCPU", APESQ_T_BOOL, 0, &percpu);
+
+    if ( (apval = apesq_get_values(sec, "Overflow"))) {
+        if (strcasecmp(apval->strdata, "block") == 0) {
+            overflow = YOLOG_OVERFLOW_BLOCK;
+        } else if (strcasecmp(apval->strdata, "drop-newest") == 0) {
+            overflow = YOLOG_OVERFLOW_DROP_NEWEST;
+        } else if (strcasecmp(apval->strdata, "drop-oldest") == 0) {
+            overflow = YOLOG_OVERFLOW_DROP_OLDEST;
+        } else if (strcasecmp(apval->strdata, "drop-below") == 0) {
+            overflow = YOLOG_OVERFLOW_DROP_BELOW;
+        } else {
+            fprintf(stderr, "Yolog: Unrecognized Overflow '%s'\n",
+                    apval->strdata);
+        }
+    }
+
+    apesq_read_value(sec, "OverflowTimeout", APESQ_T_INT, 0, &timeout);
+    if (timeout < 0) {
+        timeout = 0;
+    }
+
+    if ( (apval = apesq_get_values(sec, "OverflowLevel"))) {
+        level = yolog_level_by_name(apval->strdata);
+        if (level == -1) {
+            fprintf(stderr, "Yolog: Unrecognized level '%s'\n",
+                    apval->strdata);
+            level = YOLOG_LEVEL_MAX;
+        }
+    } else if (overflow == YOLOG_OVERFLOW_DROP_BELOW) {
+        fprintf(stderr, "Yolog: Overflow drop-below needs an OverflowLevel\n");
+    }
+
+    if ( (apval = apesq_get_values(sec, "PriorityLevel"))) {
+        if (strcasecmp(apval->strdata, "none") == 0) {
+            prio_level = YOLOG_LEVEL_MAX;
+        } else if ( (prio_level = yolog_level_by_name(apval->strdata)) == -1) {
+            fprintf(stderr, "Yolog: Unrecognized level '%s'\n",
+                    apval->strdata);
+            prio_level = YOLOG_ERROR;
+        }
+    }
+
+    apesq_read_value(sec, "PriorityWindow", APESQ_T_INT, 0, &prio_window);
+    if (prio_window < 0) {
+        prio_window = 0;
+    }
+
+    apesq_read_value(sec, "ShedDepth", APESQ_T_INT, 0, &shed_depth);
+    if (shed_depth < 0 || shed_depth > 100) {
+        fprintf(stderr, "Yolog: ShedDepth must be a percentage\n");
+        shed_depth = 0;
+    }
+
+    apesq_read_value(sec, "ShedLag", APESQ_T_INT, 0, &shed_lag);
+    if (shed_lag < 0) {
+        shed_lag = 0;
+    }
+
+    apesq_read_value(sec, "OrderWindow", APESQ_T_INT, 0, &order_window);
+    if (order_window < 0) {
+        order_window = 0;
+    }
+
+    /* the rest can be changed while the writer is running */
+    if (yolog_async_start_backend(grp, nslots, backend, percpu) == 0 ||
+            grp->async) {
+        yolog_async_set_overflow(grp, overflow, timeout, level);
+        yolog_async_set_priority(grp, prio_level, prio_window);
+        yolog_async_set_shedding(grp, shed_depth, shed_lag);
+        yolog_async_set_ordering(grp, order_window);
+    }
+}
+
 YOLOG_API
 int
 yolog_parse_file(yolog_context_group *grp,
@@ -334,6 +887,19 @@ yolog_parse_file(yolog_context_group *grp,
         fmtdfl = yolog_fmt_compile(apval->strdata);
     }
 
+    if ( (apval = apesq_get_values(secroot, "Clock"))) {
+        if (strcasecmp(apval->strdata, "tsc") == 0) {
+            if (yolog_set_clock(YOLOG_CLOCK_TSC) != 0) {
+                fprintf(stderr, "Yolog: TSC clock not available here\n");
+            }
+        } else if (strcasecmp(apval->strdata, "default") == 0) {
+            yolog_set_clock(YOLOG_CLOCK_DEFAULT);
+        } else {
+            fprintf(stderr, "Yolog: Unrecognized Clock '%s'\n",
+                    apval->strdata);
+        }
+    }
+
     secents = apesq_get_sections(root, "Output");
 
     if (!secents) {
@@ -369,6 +935,8 @@ yolog_parse_file(yolog_context_group *grp,
                 continue;
             }
             out = &grp->o_file;
+            free(out->path);
+            out->path = strdup(destpath);
         }
 
         out->fp = fp;
@@ -396,6 +964,7 @@ yolog_parse_file(yolog_context_group *grp,
         }
 
         apesq_read_value(sec, "Color", APESQ_T_BOOL, 0, &out->use_color);
+        handle_output_options(sec, out, out != &grp->o_screen);
         gout_count++;
     }
 
@@ -458,7 +1027,10 @@ yolog_parse_file(yolog_context_group *grp,
     free (secents);
 
     GT_NO_SUBSYS:
-    ;
+    handle_async(grp, root);
+
+    /* the group's outputs may have changed as well */
+    yolog_sync_group(grp);
 
     if (!fmtdfl_used) {
         free(fmtdfl);
@@ -4,9 +4,11 @@
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
 #endif
 
-/* needed for flockfile/funlockfile */
-#if (defined(__unix__) && (!defined(_POSIX_SOURCE)))
-#define _POSIX_SOURCE
+/* needed for flockfile/funlockfile and vsnprintf */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif (defined(__unix__) && (!defined(_XOPEN_SOURCE)))
+#define _XOPEN_SOURCE 600
 #endif /* __unix__ */
 
 #include <stdio.h>
@@ -28,11 +30,16 @@ struct yolog_implicit_st {
     const char *m_file;
 
     struct yolog_context *ctx;
+
+    /* outputs the message goes to, as found by implicit_begin() */
+    unsigned omask;
 };
 
 /**
  * Stuff for C89-mode logging. We can't use variadic macros
- * so we rely on a shared global context. sucks, it does.
+ * so the call site is stashed in a placeholder between implicit_begin() and
+ * implicit_logger(). Where thread-local storage is available each thread has
+ * its own; otherwise there is a single one, protected by the global mutex.
  */
 
 #ifdef __unix__
@@ -45,6 +52,11 @@ static pthread_mutex_t Yolog_Global_Mutex;
 #define yolog_dest_lock(ctx) flockfile(ctx->fp)
 #define yolog_dest_unlock(ctx) funlockfile(ctx->fp)
 
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+#define YOLOG_HAVE_WRITEV
+
 #else
 #define yolog_dest_lock(ctx)
 #define yolog_dest_unlock(ctx)
@@ -55,9 +67,17 @@ static pthread_mutex_t Yolog_Global_Mutex;
 
 #include "yolog.h"
 
+#ifdef YOLOG_TLS
+static YOLOG_TLS struct yolog_implicit_st Yolog_Implicit;
+#define yolog_implicit_lock()
+#define yolog_implicit_unlock()
+#else
 static struct yolog_implicit_st Yolog_Implicit;
-static
-yolog_context Yolog_Global_Context = {
+#define yolog_implicit_lock() yolog_global_lock()
+#define yolog_implicit_unlock() yolog_global_unlock()
+#endif /* YOLOG_TLS */
+YOLOG_API
+yolog_context yolog_global_context = {
         YOLOG_LEVEL_UNSET, /* level */
         NULL, /* parent */
         { 0 }, /* level settings */
@@ -66,7 +86,7 @@ yolog_context Yolog_Global_Context = {
 
 static
 yolog_context_group Yolog_Global_CtxGroup = {
-        &Yolog_Global_Context,
+        &yolog_global_context,
         1
 };
 
@@ -157,61 +177,19 @@ yolog_init_defaults(struct yolog_context_group *grp,
     }
 }
 
-static int
-output_can_log(yolog_context *ctx,
-            int level,
-            int oix,
-            struct yolog_output_st *output)
-{
-    if (output == NULL) {
-        return 0;
-    }
-
-    if (output->fp == NULL) {
-        return 0;
-    }
-
-    if (ctx->olevels[oix] != YOLOG_LEVEL_UNSET) {
-        if (ctx->olevels[oix] <= level) {
-            return 1;
-        } else {
-            return 0;
-        }
-    }
-
-    if (output->level != YOLOG_LEVEL_UNSET) {
-        if (output->level <= level) {
-            return 1;
-        }
-    }
-    return 0;
-}
-
-
-
-static int
-ctx_can_log(yolog_context *ctx,
-            int level,
-            struct yolog_output_st *outputs[YOLOG_OUTPUT_COUNT+1])
+/**
+ * Returns the mask of outputs which accept this level, as precomputed by
+ * yolog_sync_levels
+ */
+static unsigned
+ctx_omask(yolog_context *ctx, int level)
 {
-    int ii;
-    outputs[YOLOG_OUTPUT_GFILE] = &ctx->parent->o_file;
-    outputs[YOLOG_OUTPUT_SCREEN] = &ctx->parent->o_screen;
-    outputs[YOLOG_OUTPUT_PFILE] = ctx->o_alt;
-
-    if (ctx->level != YOLOG_LEVEL_UNSET && ctx->level > ctx->level) {
+    if (level < 0 || level >= YOLOG_LEVEL_MAX || level < ctx->shed) {
         return 0;
     }
-
-    for (ii = 0; ii < YOLOG_OUTPUT_COUNT; ii++) {
-        if (output_can_log(ctx, level, ii, outputs[ii])) {
-            return 1;
-        }
-    }
-    return 0;
+    return ctx->omasks[level];
 }
 
-
 static void
 yolog_get_formats(struct yolog_output_st *output,
                   int level,
@@ -253,8 +231,675 @@ yolog_get_formats(struct yolog_output_st *output,
 #define CAN_LOG(lvl, ctx) \
     (level >= ctx->level)
 
+/**
+ * Size of the on-stack body buffer when there is no thread-local storage.
+ * Longer messages are truncated.
+ */
+#define YOLOG_BODY_STACKBUF 1024
+
+#ifndef va_copy
+#define YOLOG_VACOPY_OVERRIDE
+#ifdef __GNUC__
+#define va_copy __va_copy
+#else
+#define va_copy(dst, src) (dst) = (src)
+#endif /* __GNUC__ */
+#endif
+
+static struct yolog_output_st *
+ctx_get_output(yolog_context *ctx, int oix)
+{
+    switch (oix) {
+    case YOLOG_OUTPUT_SCREEN:
+        return &ctx->parent->o_screen;
+    case YOLOG_OUTPUT_GFILE:
+        return &ctx->parent->o_file;
+    case YOLOG_OUTPUT_PFILE:
+        return ctx->o_alt;
+    default:
+        return NULL;
+    }
+}
+
+unsigned
+yolog_text_omask(yolog_context *ctx, unsigned omask)
+{
+    int ii;
+
+    for (ii = 0; ii < YOLOG_OUTPUT_COUNT; ii++) {
+        struct yolog_output_st *out;
+
+        if ((omask & (1 << ii)) == 0) {
+            continue;
+        }
+
+        out = ctx_get_output(ctx, ii);
+        if (!out || (out->flags &
+                (YOLOG_OUTPUT_F_BINARY|YOLOG_OUTPUT_F_PERTHREAD))) {
+            omask &= ~(1 << ii);
+        }
+    }
+    return omask;
+}
+
 void
-yolog_vlogger(yolog_context *ctx,
+yolog_sync_headers(yolog_context *ctx)
+{
+    int ii, lvl;
+
+    for (ii = 0; ii < YOLOG_OUTPUT_COUNT; ii++) {
+        struct yolog_output_st *out = NULL;
+
+        if (ctx->parent) {
+            out = ctx_get_output(ctx, ii);
+        }
+
+        for (lvl = 0; lvl < YOLOG_LEVEL_MAX; lvl++) {
+            struct yolog_msginfo_st minfo;
+
+            free(ctx->headers[ii][lvl]);
+            ctx->headers[ii][lvl] = NULL;
+
+            if (out == NULL || out->fmtv == NULL ||
+                    (out->flags & YOLOG_OUTPUT_F_BINARY) ||
+                    (ctx->omasks[lvl] & (1 << ii)) == 0) {
+                continue;
+            }
+
+            memset(&minfo, 0, sizeof(minfo));
+            minfo.m_level = lvl;
+            minfo.m_prefix = ctx->prefix && *ctx->prefix ? ctx->prefix : "-";
+            yolog_get_formats(out, lvl, &minfo);
+            ctx->headers[ii][lvl] = yolog_fmt_precompile(out->fmtv, &minfo);
+        }
+    }
+}
+
+#ifdef YOLOG_TLS
+static YOLOG_TLS char Yolog_Linebuf[YOLOG_LINE_MAX];
+static YOLOG_TLS char Yolog_Bodybuf[YOLOG_LINE_MAX];
+#endif
+
+#ifdef YOLOG_HAVE_WRITEV
+static void
+output_write_atomic(struct yolog_output_st *out,
+                    const char *line, size_t nline,
+                    const char *body, size_t nbody,
+                    const char *tail, size_t ntail)
+{
+    struct iovec iov[3];
+    int niov = 0;
+    ssize_t rv;
+
+    iov[niov].iov_base = (void*)line;
+    iov[niov++].iov_len = nline;
+    if (nbody) {
+        iov[niov].iov_base = (void*)body;
+        iov[niov++].iov_len = nbody;
+    }
+    if (ntail) {
+        iov[niov].iov_base = (void*)tail;
+        iov[niov++].iov_len = ntail;
+    }
+
+    /**
+     * A single write(2) on an O_APPEND descriptor is not interleaved with
+     * other writers. Short writes only happen on pipes and terminals, in
+     * which case we finish off the line.
+     */
+    while (niov) {
+        rv = writev(out->fd, iov, niov);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        while (niov && (size_t)rv >= iov[0].iov_len) {
+            rv -= iov[0].iov_len;
+            memmove(iov, iov + 1, sizeof(iov[0]) * --niov);
+        }
+        if (niov) {
+            iov[0].iov_base = (char*)iov[0].iov_base + rv;
+            iov[0].iov_len -= rv;
+        }
+    }
+}
+#endif /* YOLOG_HAVE_WRITEV */
+
+void
+yolog_emit(yolog_context *ctx,
+           unsigned omask,
+           struct yolog_msginfo_st *minfo,
+           const char *body,
+           size_t nbody,
+           struct yolog_io_st *io)
+{
+    int ii;
+
+    for (ii = 0; ii < YOLOG_OUTPUT_COUNT; ii++) {
+        struct yolog_output_st *out;
+
+        if ((omask & (1 << ii)) == 0) {
+            continue;
+        }
+
+        out = ctx_get_output(ctx, ii);
+        if (!out) {
+            /* e.g. a report for another context's per-subsystem file */
+            continue;
+        }
+
+        if ((out->flags & YOLOG_OUTPUT_F_DEDUP) &&
+                yolog_dedup_check(out, ctx, ii, minfo, body, nbody, io)) {
+            /* a repeat; only counted */
+            continue;
+        }
+
+        yolog_emit_output(ctx, ii, minfo, body, nbody, io);
+    }
+}
+
+void
+yolog_emit_output(yolog_context *ctx,
+                  int oix,
+                  struct yolog_msginfo_st *minfo,
+                  const char *body,
+                  size_t nbody,
+                  struct yolog_io_st *io)
+{
+    struct yolog_output_st *out = ctx_get_output(ctx, oix);
+    struct yolog_iobatch_st *batch;
+    size_t nline, ntail;
+    const char *xbody = body;
+    size_t nxbody = nbody;
+    unsigned long dseq = 0;
+    int flush = (io == NULL);
+#ifdef YOLOG_TLS
+    char *lbuf = Yolog_Linebuf;
+#else
+    char lbuf[YOLOG_LINE_MAX];
+#endif
+
+    if (!out) {
+        return;
+    }
+
+    yolog_get_formats(out, minfo->m_level, minfo);
+
+    yolog_tsc_resolve(minfo);
+
+    /**
+     * Assemble the whole line in the per-thread buffer. If the body
+     * does not fit, it is written from where it is.
+     */
+    if (ctx->headers[oix][minfo->m_level]) {
+        nline = yolog_hdr_render(ctx->headers[oix][minfo->m_level],
+                                 lbuf, YOLOG_LINE_MAX, minfo);
+    } else {
+        nline = yolog_fmt_render(out->fmtv, lbuf, YOLOG_LINE_MAX, minfo);
+    }
+    ntail = strlen(minfo->co_reset);
+
+    if (nline + nbody + ntail + 1 <= YOLOG_LINE_MAX) {
+        memcpy(lbuf + nline, body, nbody);
+        nline += nbody;
+        memcpy(lbuf + nline, minfo->co_reset, ntail);
+        nline += ntail;
+        lbuf[nline++] = '\n';
+        xbody = NULL;
+        nxbody = 0;
+    }
+
+    if (out->flags & YOLOG_OUTPUT_F_PERTHREAD) {
+        yolog_perthread_write(out, minfo, lbuf, nline, xbody, nxbody);
+        return;
+    }
+
+    batch = yolog_io_batch(io, out);
+    if (batch ||
+            (out->flags & (YOLOG_OUTPUT_F_ATOMIC|YOLOG_OUTPUT_F_MAPPED))) {
+        /* color reset followed by the newline */
+        char tail[32];
+        size_t ntotal = nline;
+
+        if (xbody) {
+            memcpy(tail, minfo->co_reset, ntail);
+            tail[ntail++] = '\n';
+            ntotal += nxbody + ntail;
+        } else {
+            ntail = 0;
+        }
+
+        if (batch) {
+            yolog_io_append(io, batch, lbuf, nline, xbody, nxbody,
+                            tail, ntail);
+        } else if (out->flags & YOLOG_OUTPUT_F_MAPPED) {
+            yolog_mapped_write(out, lbuf, nline, xbody, nxbody,
+                               tail, ntail);
+        }
+#ifdef YOLOG_HAVE_WRITEV
+        else {
+            output_write_atomic(out, lbuf, nline, xbody, nxbody,
+                                tail, ntail);
+        }
+#endif
+
+        if (out->rotate) {
+            yolog_rotate_account(out, ntotal);
+        }
+
+        if (out->durable) {
+            dseq = yolog_durable_mark(out, minfo->m_level);
+            if (dseq && flush) {
+                yolog_durable_wait(out, dseq);
+            }
+        }
+        return;
+    }
+
+    yolog_dest_lock(out);
+    fwrite(lbuf, 1, nline, out->fp);
+    if (xbody) {
+        fwrite(xbody, 1, nxbody, out->fp);
+        fputs(minfo->co_reset, out->fp);
+        putc('\n', out->fp);
+    }
+    if (flush) {
+        yolog_output_written(out, minfo->m_level);
+    }
+    if (out->durable) {
+        dseq = yolog_durable_mark(out, minfo->m_level);
+    }
+    yolog_dest_unlock(out);
+
+    if (out->rotate) {
+        yolog_rotate_account(out, nline + (xbody ? nxbody + ntail + 1 : 0));
+    }
+
+    /* the asynchronous writer doesn't wait */
+    if (dseq && flush) {
+        yolog_durable_wait(out, dseq);
+    }
+}
+
+static unsigned long
+yolog_now_ms(void)
+{
+#ifdef __unix__
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+#else
+    return 0;
+#endif
+}
+
+void
+yolog_output_written(struct yolog_output_st *out, int level)
+{
+    if (out->buffering == YOLOG_BUFFER_DEFAULT) {
+        fflush(out->fp);
+        return;
+    }
+
+    if (out->buffering == YOLOG_BUFFER_NONE) {
+        return;
+    }
+
+    if (level >= out->flush_level) {
+        fflush(out->fp);
+        out->dirty = 0;
+        out->last_flush = yolog_now_ms();
+        return;
+    }
+
+    if (!out->dirty) {
+        /* the interval counts from the first unflushed message */
+        out->dirty = 1;
+        out->last_flush = yolog_now_ms();
+    }
+}
+
+#ifdef __unix__
+#define YOLOG_FLUSHER_MAX 64
+
+static struct yolog_output_st *Yolog_Flusher_Outputs[YOLOG_FLUSHER_MAX];
+static int Yolog_Flusher_Count;
+static pthread_mutex_t Yolog_Flusher_Mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+flusher_main(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        int ii, count;
+        unsigned long now, wait = 1000;
+        struct timespec ts;
+
+        pthread_mutex_lock(&Yolog_Flusher_Mutex);
+        count = Yolog_Flusher_Count;
+        pthread_mutex_unlock(&Yolog_Flusher_Mutex);
+
+        now = yolog_now_ms();
+
+        for (ii = 0; ii < count; ii++) {
+            struct yolog_output_st *out = Yolog_Flusher_Outputs[ii];
+            unsigned long age;
+
+            if (out->fp == NULL) {
+                continue;
+            }
+
+            yolog_dest_lock(out);
+            age = 0;
+            if (out->dirty) {
+                age = now - out->last_flush;
+                if (age >= out->flush_interval) {
+                    fflush(out->fp);
+                    out->dirty = 0;
+                    age = 0;
+                }
+            }
+            yolog_dest_unlock(out);
+
+            /* sleep until the oldest unflushed data is due */
+            if (out->flush_interval - age < wait) {
+                wait = out->flush_interval - age;
+            }
+        }
+
+        if (wait < 10) {
+            wait = 10;
+        }
+        ts.tv_sec = wait / 1000;
+        ts.tv_nsec = (wait % 1000) * 1000000L;
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+int
+yolog_flusher_add(struct yolog_output_st *out)
+{
+    int ii, rv = 0;
+
+    pthread_mutex_lock(&Yolog_Flusher_Mutex);
+
+    for (ii = 0; ii < Yolog_Flusher_Count; ii++) {
+        if (Yolog_Flusher_Outputs[ii] == out) {
+            goto GT_DONE;
+        }
+    }
+
+    if (Yolog_Flusher_Count == YOLOG_FLUSHER_MAX) {
+        rv = -1;
+        goto GT_DONE;
+    }
+
+    if (Yolog_Flusher_Count == 0) {
+        pthread_t thr;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        rv = pthread_create(&thr, &attr, flusher_main, NULL);
+        pthread_attr_destroy(&attr);
+
+        if (rv != 0) {
+            rv = -1;
+            goto GT_DONE;
+        }
+    }
+
+    Yolog_Flusher_Outputs[Yolog_Flusher_Count++] = out;
+
+    GT_DONE:
+    pthread_mutex_unlock(&Yolog_Flusher_Mutex);
+    return rv;
+}
+#else
+int
+yolog_flusher_add(struct yolog_output_st *out)
+{
+    (void)out;
+    return -1;
+}
+#endif /* __unix__ */
+
+#ifdef __unix__
+struct yolog_durable_st {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* messages at or above this level are made durable */
+    int level;
+
+    /* whether the logging thread waits for its message to be durable */
+    int wait;
+
+    /* last sequence number written, and last one known to be durable */
+    unsigned long written;
+    unsigned long synced;
+
+    /* set in a forked child, which has to start its own committing thread */
+    volatile int restart;
+
+    struct yolog_output_st *out;
+    struct yolog_durable_st *next;
+};
+
+/* all durable outputs, for fork */
+static struct yolog_durable_st *Yolog_Durable_List;
+static pthread_mutex_t Yolog_Durable_Mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t Yolog_Durable_Once = PTHREAD_ONCE_INIT;
+
+static void *
+durable_main(void *arg)
+{
+    struct yolog_output_st *out = arg;
+    struct yolog_durable_st *d = out->durable;
+
+    pthread_mutex_lock(&d->mutex);
+    for (;;) {
+        unsigned long target;
+
+        while (d->synced == d->written) {
+            pthread_cond_wait(&d->cond, &d->mutex);
+        }
+
+        /**
+         * Everything up to 'target' has already been handed to the kernel;
+         * one fdatasync covers all of it, and whatever arrives meanwhile
+         * goes in the next one.
+         */
+        target = d->written;
+        pthread_mutex_unlock(&d->mutex);
+
+        fdatasync(fileno(out->fp));
+
+        pthread_mutex_lock(&d->mutex);
+        d->synced = target;
+        pthread_cond_broadcast(&d->cond);
+    }
+    return NULL;
+}
+
+static int
+durable_start(struct yolog_output_st *out)
+{
+    pthread_t thr;
+    pthread_attr_t attr;
+    int rv;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rv = pthread_create(&thr, &attr, durable_main, out);
+    pthread_attr_destroy(&attr);
+    return rv;
+}
+
+/**
+ * The committing threads don't exist in a forked child. Each output gets
+ * a fresh lock, and its thread is started again by the next message which
+ * needs it (a new thread is better not started from here).
+ */
+static void
+durable_atfork_child(void)
+{
+    struct yolog_durable_st *d;
+
+    for (d = Yolog_Durable_List; d; d = d->next) {
+        pthread_mutex_init(&d->mutex, NULL);
+        pthread_cond_init(&d->cond, NULL);
+        d->synced = d->written;
+        d->restart = 1;
+    }
+    pthread_mutex_init(&Yolog_Durable_Mutex, NULL);
+}
+
+static void
+durable_atfork_register(void)
+{
+    pthread_atfork(NULL, NULL, durable_atfork_child);
+}
+
+int
+yolog_durable_init(struct yolog_output_st *out, int level, int wait)
+{
+    struct yolog_durable_st *d;
+
+    if (out->durable) {
+        /* already running; only the policy changes */
+        pthread_mutex_lock(&out->durable->mutex);
+        out->durable->level = level;
+        out->durable->wait = wait;
+        pthread_mutex_unlock(&out->durable->mutex);
+        return 0;
+    }
+
+    d = calloc(1, sizeof(*d));
+    if (!d) {
+        return -1;
+    }
+
+    pthread_mutex_init(&d->mutex, NULL);
+    pthread_cond_init(&d->cond, NULL);
+    d->level = level;
+    d->wait = wait;
+    d->out = out;
+    out->durable = d;
+
+    if (durable_start(out) != 0) {
+        out->durable = NULL;
+        pthread_cond_destroy(&d->cond);
+        pthread_mutex_destroy(&d->mutex);
+        free(d);
+        return -1;
+    }
+
+    pthread_once(&Yolog_Durable_Once, durable_atfork_register);
+    pthread_mutex_lock(&Yolog_Durable_Mutex);
+    d->next = Yolog_Durable_List;
+    Yolog_Durable_List = d;
+    pthread_mutex_unlock(&Yolog_Durable_Mutex);
+    return 0;
+}
+
+unsigned long
+yolog_durable_mark(struct yolog_output_st *out, int level)
+{
+    struct yolog_durable_st *d = out->durable;
+    unsigned long seq;
+
+    if (level < d->level) {
+        return 0;
+    }
+
+    /* the data must reach the kernel before it is counted */
+    if (!(out->flags & YOLOG_OUTPUT_F_ATOMIC)) {
+        fflush(out->fp);
+    }
+
+    pthread_mutex_lock(&d->mutex);
+    if (d->restart) {
+        if (durable_start(out) != 0) {
+            /* nothing to wait for; commit it here */
+            pthread_mutex_unlock(&d->mutex);
+            fdatasync(fileno(out->fp));
+            return 0;
+        }
+        d->restart = 0;
+    }
+    seq = ++d->written;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+    return seq;
+}
+
+void
+yolog_durable_wait(struct yolog_output_st *out, unsigned long seq)
+{
+    struct yolog_durable_st *d = out->durable;
+
+    pthread_mutex_lock(&d->mutex);
+    if (d->wait) {
+        /* sequence numbers may wrap */
+        while ((long)(seq - d->synced) > 0) {
+            pthread_cond_wait(&d->cond, &d->mutex);
+        }
+    }
+    pthread_mutex_unlock(&d->mutex);
+}
+
+#else
+int
+yolog_durable_init(struct yolog_output_st *out, int level, int wait)
+{
+    (void)out; (void)level; (void)wait;
+    return -1;
+}
+
+unsigned long
+yolog_durable_mark(struct yolog_output_st *out, int level)
+{
+    (void)out; (void)level;
+    return 0;
+}
+
+void
+yolog_durable_wait(struct yolog_output_st *out, unsigned long seq)
+{
+    (void)out; (void)seq;
+}
+#endif /* __unix__ */
+
+void
+yolog_flush_outputs(yolog_context_group *grp)
+{
+    int ii;
+    if (grp->o_screen.fp) {
+        fflush(grp->o_screen.fp);
+    }
+    if (grp->o_file.fp) {
+        fflush(grp->o_file.fp);
+    }
+    for (ii = 0; ii < grp->ncontexts; ii++) {
+        if (grp->contexts[ii].o_alt && grp->contexts[ii].o_alt->fp) {
+            fflush(grp->contexts[ii].o_alt->fp);
+        }
+    }
+}
+
+/**
+ * Logs to the outputs in omask, which the caller has already found with
+ * ctx_omask() and knows to be non-empty
+ */
+static void
+vlogger_omask(yolog_context *ctx,
+              unsigned omask,
               yolog_level_t level,
               const char *file,
               int line,
@@ -264,16 +909,16 @@ yolog_vlogger(yolog_context *ctx,
 {
     struct yolog_msginfo_st msginfo;
     const char *prefix;
-    int ii;
-    struct yolog_output_st *outputs[YOLOG_OUTPUT_COUNT];
-
-    if (!ctx) {
-        ctx = &Yolog_Global_Context;
-    }
-
-    if (!ctx_can_log(ctx, level, outputs)) {
-        return;
-    }
+    int ii, nbody;
+    unsigned tmask = 0;
+    va_list vacp;
+#ifdef YOLOG_TLS
+    char *body = Yolog_Bodybuf;
+    const int nbodybuf = YOLOG_LINE_MAX;
+#else
+    char body[YOLOG_BODY_STACKBUF];
+    const int nbodybuf = YOLOG_BODY_STACKBUF;
+#endif
 
     prefix = ctx->prefix;
     if (prefix == NULL || *prefix == '\0') {
@@ -281,7 +926,9 @@ yolog_vlogger(yolog_context *ctx,
     }
 
     if (ctx->parent->cb) {
-        ctx->parent->cb(ctx, level, ap);
+        va_copy(vacp, ap);
+        ctx->parent->cb(ctx, level, vacp);
+        va_end(vacp);
     }
 
     msginfo.m_file = file;
@@ -289,48 +936,112 @@ yolog_vlogger(yolog_context *ctx,
     msginfo.m_line = line;
     msginfo.m_prefix = prefix;
     msginfo.m_func = fn;
+    msginfo.m_time = 0;
+    msginfo.m_nsec = 0;
+    msginfo.m_mono_sec = 0;
+    msginfo.m_mono_nsec = 0;
+    msginfo.m_tid = 0;
+    /* numbered as late as possible, see below */
+    msginfo.m_seq = 0;
+    msginfo.m_tsc = 0;
+
+    /* one time for every output, and every time field of their headers */
+    yolog_msginfo_stamp(&msginfo);
 
     for (ii = 0; ii < YOLOG_OUTPUT_COUNT; ii++) {
-        struct yolog_output_st *out = outputs[ii];
-        FILE *fp;
-        struct yolog_fmt_st *fmtv;
+        struct yolog_output_st *out;
 
-        if (!output_can_log(ctx, level, ii,  out)) {
+        if (!(omask & (1 << ii))) {
             continue;
         }
 
-        fmtv = out->fmtv;
-        fp = out->fp;
+        out = ctx_get_output(ctx, ii);
+        if (out->flags & YOLOG_OUTPUT_F_BINARY) {
+            /* binary outputs take the raw arguments */
+            if (!msginfo.m_seq) {
+                msginfo.m_seq = yolog_next_seq();
+            }
+            va_copy(vacp, ap);
+            yolog_binlog_write(out, ctx, &msginfo, fmt, vacp);
+            va_end(vacp);
+            omask &= ~(1 << ii);
 
-        yolog_get_formats(out, level, &msginfo);
+        } else if (out->flags & YOLOG_OUTPUT_F_PERTHREAD) {
+            /* always written by the logging thread, to its own file */
+            tmask |= 1 << ii;
+            omask &= ~(1 << ii);
+        }
+    }
 
-        yolog_dest_lock(out);
+    if (omask && ctx->parent->async) {
+        int rv;
+        va_copy(vacp, ap);
+        rv = yolog_async_push(ctx->parent->async, ctx, omask,
+                              &msginfo, fmt, vacp);
+        va_end(vacp);
 
-#ifndef va_copy
-#define YOLOG_VACOPY_OVERRIDE
-#ifdef __GNUC__
-#define va_copy __va_copy
-#else
-#define va_copy(dst, src) (dst) = (src)
-#endif /* __GNUC__ */
-#endif
-
-        yolog_fmt_write(fmtv, fp, &msginfo);
-        {
-            va_list vacp;
-            va_copy(vacp, ap);
-            vfprintf(fp, fmt, vacp);
-            va_end(vacp);
+        if (rv == 0) {
+            omask = 0;
         }
-        fprintf(fp, "%s\n", msginfo.co_reset);
-        fflush(fp);
-        yolog_dest_unlock(out);
     }
+
+    omask |= tmask;
+    if (!omask) {
+        return;
+    }
+
+    /**
+     * Queued messages are numbered once they have a slot; numbering them
+     * before they wait for one would put them out of order.
+     */
+    if (!msginfo.m_seq) {
+        msginfo.m_seq = yolog_next_seq();
+    }
+
+    /**
+     * Render the message body once; only the header differs between
+     * outputs. This does not allocate; overlong messages are truncated.
+     */
+    va_copy(vacp, ap);
+    nbody = yolog_vformat(body, nbodybuf, fmt, vacp);
+    va_end(vacp);
+
+    if (nbody < 0) {
+        nbody = 0;
+    } else if (nbody >= nbodybuf) {
+        nbody = nbodybuf - 1;
+    }
+
+    yolog_emit(ctx, omask, &msginfo, body, nbody, NULL);
+}
+
+void
+yolog_vlogger(yolog_context *ctx,
+              yolog_level_t level,
+              const char *file,
+              int line,
+              const char *fn,
+              const char *fmt,
+              va_list ap)
+{
+    unsigned omask;
+
+    if (!ctx) {
+        ctx = &yolog_global_context;
+    }
+
+    omask = ctx_omask(ctx, level);
+    if (!omask) {
+        return;
+    }
+
+    vlogger_omask(ctx, omask, level, file, line, fn, fmt, ap);
+}
+
 #ifdef YOLOG_VACOPY_OVERRIDE
 #undef va_copy
 #undef YOLOG_VACOPY_OVERRIDE
 #endif
-}
 
 void
 yolog_logger(yolog_context *ctx,
@@ -354,17 +1065,20 @@ yolog_implicit_begin(yolog_context *ctx,
                      int line,
                      const char *fn)
 {
-    struct yolog_output_st *outputs[YOLOG_OUTPUT_COUNT];
+    unsigned omask;
+
     if (!ctx) {
-        ctx = &Yolog_Global_Context;
+        ctx = &yolog_global_context;
     }
 
-    if (!ctx_can_log(ctx, level, outputs)) {
+    omask = ctx_omask(ctx, level);
+    if (!omask) {
         return 0;
     }
 
-    yolog_global_lock();
+    yolog_implicit_lock();
 
+    Yolog_Implicit.omask = omask;
     Yolog_Implicit.ctx = ctx;
     Yolog_Implicit.level = level;
     Yolog_Implicit.m_file = file;
@@ -376,7 +1090,7 @@ yolog_implicit_begin(yolog_context *ctx,
 void
 yolog_implicit_end(void)
 {
-    yolog_global_unlock();
+    yolog_implicit_unlock();
 }
 
 void
@@ -384,7 +1098,9 @@ yolog_implicit_logger(const char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
-    yolog_vlogger(Yolog_Implicit.ctx,
+    /* the level was already checked by implicit_begin() */
+    vlogger_omask(Yolog_Implicit.ctx,
+                  Yolog_Implicit.omask,
                   Yolog_Implicit.level,
                   Yolog_Implicit.m_file,
                   Yolog_Implicit.m_line,
@@ -395,9 +1111,22 @@ yolog_implicit_logger(const char *fmt, ...)
     va_end(ap);
 }
 
+/* last sequence number given out */
+static volatile unsigned long Yolog_Seq;
+
+unsigned long
+yolog_next_seq(void)
+{
+#ifdef __GNUC__
+    return __sync_add_and_fetch(&Yolog_Seq, 1);
+#else
+    return ++Yolog_Seq;
+#endif
+}
+
 yolog_context *
 yolog_get_global(void) {
-    return &Yolog_Global_Context;
+    return &yolog_global_context;
 }
 
 
@@ -411,4 +1140,5 @@ yolog_set_screen_format(yolog_context_group *grp,
     }
 
     yolog_set_fmtstr(&grp->o_screen, format, 1);
+    yolog_sync_group(grp);
 }
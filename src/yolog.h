@@ -146,6 +146,15 @@ enum {
 
 struct yolog_context;
 struct yolog_fmt_st;
+struct yolog_async_st;
+struct yolog_binlog_st;
+struct yolog_durable_st;
+struct yolog_rotate_st;
+struct yolog_mapped_st;
+struct yolog_dedup_st;
+struct yolog_perthread_st;
+struct yolog_io_st;
+struct yolog_iobatch_st;
 
 /**
  * Callback to be invoked when a logging message arrives.
@@ -194,18 +203,42 @@ enum {
     YOLOG_FMT_FILENAME,
     YOLOG_FMT_LINE,
     YOLOG_FMT_FUNC,
-    YOLOG_FMT_COLOR
+    YOLOG_FMT_COLOR,
+    YOLOG_FMT_TIME,
+    YOLOG_FMT_MONO,
+    YOLOG_FMT_TNAME,
+    YOLOG_FMT_SEQ
 };
 
+/* size of a thread name for %(tname), including the NUL */
+#define YOLOG_TNAME_MAX 16
+
 
 /* structure representing a single compiled format specifier */
 struct yolog_fmt_st {
     /* format type, opaque, derived from format string */
     int type;
+    /* argument to the specifier, e.g. the fraction digits of %(time:us) */
+    int arg;
     /* user string, heading or trailing padding, depending on the type */
     char ustr[YOLOG_FMT_USTR_MAX];
 };
 
+/**
+ * A header pre-rendered for a given output, context and level. All fields
+ * which do not change between messages (user strings, prefix, level name and
+ * color escapes) are concatenated into 'text'; only the field following it
+ * needs to be rendered for each message. A list of these is terminated by a
+ * segment of type YOLOG_FMT_LISTEND, which holds the trailing text.
+ */
+struct yolog_hdrseg_st {
+    const char *text;
+    size_t ntext;
+    /* YOLOG_FMT_* of the dynamic field following the text */
+    int type;
+    int arg;
+};
+
 struct yolog_msginfo_st {
     const char *co_line;
     const char *co_title;
@@ -217,7 +250,87 @@ struct yolog_msginfo_st {
 
     int m_level;
     int m_line;
+
+    /**
+     * These are captured by the logging thread when the message is not
+     * rendered immediately (i.e. in asynchronous mode). If zero, they are
+     * computed at render time.
+     */
     unsigned long m_time;
+    unsigned long m_nsec;
+    unsigned long m_mono_sec;
+    unsigned long m_mono_nsec;
+    unsigned long m_tid;
+    char m_tname[YOLOG_TNAME_MAX];
+
+    /* order in which the message was logged, see yolog_next_seq() */
+    unsigned long m_seq;
+
+    /**
+     * Raw counter value when the message was logged with the TSC clock
+     * (see yolog_set_clock), until it is converted into the times above
+     */
+    unsigned long m_tsc;
+};
+
+enum {
+    /**
+     * Write each message with a single write(2) on the underlying descriptor
+     * (which should be opened with O_APPEND) rather than through stdio. The
+     * line is assembled in a per-thread buffer, so no lock is taken.
+     */
+    YOLOG_OUTPUT_F_ATOMIC = 0x1,
+
+    /**
+     * Write messages in the binary log format (see below) rather than
+     * formatting them. Only valid for file outputs.
+     */
+    YOLOG_OUTPUT_F_BINARY = 0x2,
+
+    /**
+     * Copy each message into a shared mapping of the (preallocated) file
+     * rather than writing it. Only valid for file outputs.
+     */
+    YOLOG_OUTPUT_F_MAPPED = 0x4,
+
+    /**
+     * Count repeats of the last message rather than writing them, and
+     * write a summary line instead
+     */
+    YOLOG_OUTPUT_F_DEDUP = 0x8,
+
+    /**
+     * Have each thread write to its own file, path.<tid>, rather than to the
+     * shared one. Each line is prefixed with a merge key (see below). Only
+     * valid for text file outputs.
+     */
+    YOLOG_OUTPUT_F_PERTHREAD = 0x10
+};
+
+/**
+ * Per-thread files.
+ *
+ * Each line written to a per-thread file starts with the time the message
+ * was logged and its sequence number, as
+ *  "<seconds>.<9 digit nanoseconds> <seq> "
+ * followed by the line as it would appear in the shared file. Lines which
+ * do not start with a key continue the message before them. The yolog-merge
+ * utility merges the files back into one stream, ordered by these keys.
+ */
+
+/* maximum size of a message line assembled in the per-thread buffer */
+#define YOLOG_LINE_MAX 4096
+
+/* stdio buffering of an output, the 'Buffering' option */
+enum {
+    /* flush after each message */
+    YOLOG_BUFFER_DEFAULT = 0,
+    /* unbuffered; every message is written right away */
+    YOLOG_BUFFER_NONE,
+    /* written after each line */
+    YOLOG_BUFFER_LINE,
+    /* written when the buffer (of 'BufferSize' bytes) fills up */
+    YOLOG_BUFFER_BLOCK
 };
 
 struct yolog_output_st {
@@ -225,6 +338,103 @@ struct yolog_output_st {
     struct yolog_fmt_st *fmtv;
     int use_color;
     int level;
+
+    /* YOLOG_OUTPUT_F_* */
+    int flags;
+
+    /* descriptor for YOLOG_OUTPUT_F_ATOMIC, this is fileno(fp) */
+    int fd;
+
+    /* call site table for YOLOG_OUTPUT_F_BINARY */
+    struct yolog_binlog_st *binlog;
+
+    /* YOLOG_BUFFER_* */
+    int buffering;
+
+    /* buffered messages at or above this level are flushed right away */
+    int flush_level;
+
+    /* buffered data is flushed at least this often (milliseconds) */
+    unsigned long flush_interval;
+
+    /* monotonic time of the last flush (milliseconds) */
+    unsigned long last_flush;
+
+    /* whether anything was written since the last flush */
+    int dirty;
+
+    /* group commit state, for outputs with a DurableLevel */
+    struct yolog_durable_st *durable;
+
+    /* path the output was opened from, NULL for the screen */
+    char *path;
+
+    /* rotation state, for outputs with a MaxSize or RotateEvery */
+    struct yolog_rotate_st *rotate;
+
+    /* mapping state for YOLOG_OUTPUT_F_MAPPED */
+    struct yolog_mapped_st *mapped;
+
+    /* repeated message state, for YOLOG_OUTPUT_F_DEDUP */
+    struct yolog_dedup_st *dedup;
+
+    /* thread-specific file key, for YOLOG_OUTPUT_F_PERTHREAD */
+    struct yolog_perthread_st *perthread;
+};
+
+/**
+ * Binary log format.
+ *
+ * Binary outputs don't format messages at all. Instead, the first time a
+ * call site logs to the output its printf format is parsed and a definition
+ * record is written, and each message then only records the call site's
+ * ID, a timestamp, the thread and the raw argument values. The yolog-decode
+ * utility turns the file back into text.
+ *
+ * All integers are in host byte order. Strings in definitions are prefixed
+ * with a 16 bit length, and string arguments with a 32 bit length.
+ *
+ * Session header, written whenever the file is (re)opened:
+ *  "YOLOGBIN" u32 version, u32 0x01020304 (byte order marker)
+ *
+ * Definition:
+ *  'D' u32 id, u32 line, str prefix, str file, str func, str format,
+ *  str argument types (YOLOG_BINLOG_T_*)
+ *
+ * Message:
+ *  'M' u32 id, u8 level, u64 seconds, u32 nanoseconds, u64 thread,
+ *  u64 sequence number (since version 2), u32 payload length, payload (the
+ *  arguments, in order)
+ *
+ * Integers and pointers are stored as 64 bit values, doubles as their 8
+ * byte representation. Text lines beginning with '-' (i.e. the "Mark"
+ * lines) may appear between records and are passed through.
+ */
+#define YOLOG_BINLOG_MAGIC "YOLOGBIN"
+#define YOLOG_BINLOG_VERSION 2
+
+enum {
+    YOLOG_BINLOG_REC_DEFINE = 'D',
+    YOLOG_BINLOG_REC_MESSAGE = 'M'
+};
+
+enum {
+    /* a conversion which consumes no argument, i.e. %% */
+    YOLOG_BINLOG_T_NONE = 0,
+    YOLOG_BINLOG_T_INT = 'i',
+    YOLOG_BINLOG_T_LONG = 'l',
+    YOLOG_BINLOG_T_LLONG = 'q',
+    YOLOG_BINLOG_T_SIZE = 'z',
+    YOLOG_BINLOG_T_PTRDIFF = 't',
+    YOLOG_BINLOG_T_DOUBLE = 'd',
+    YOLOG_BINLOG_T_STRING = 's',
+    YOLOG_BINLOG_T_PTR = 'p',
+
+    /**
+     * The format has conversions which can't be deferred (%n, %ls, %Lf...)
+     * so the message is formatted when logged and stored as one string.
+     */
+    YOLOG_BINLOG_T_TEXT = 'T'
 };
 
 struct yolog_context;
@@ -235,6 +445,12 @@ typedef struct yolog_context_group {
     yolog_callback cb;
     struct yolog_output_st o_file;
     struct yolog_output_st o_screen;
+
+    /**
+     * If not NULL, messages are queued here and written by a background
+     * thread. See yolog_async_start()
+     */
+    struct yolog_async_st *async;
 } yolog_context_group;
 
 typedef struct yolog_context {
@@ -242,9 +458,15 @@ typedef struct yolog_context {
      * The minimum allowable logging level.
      * Performance number so we don't have to iterate over the entire
      * olevels array each time. This should be kept in sync with sync_levels
-     * after any modification to olevels
+     * after any modification to olevels or to the group's outputs.
+     *
+     * This is the lowest level accepted by any of the context's outputs
+     * (YOLOG_LEVEL_MAX if none), and is checked inline by the generated
+     * macros before any arguments are evaluated. YOLOG_LEVEL_UNSET means
+     * the context has not been set up yet. The asynchronous writer may
+     * change it while other threads are logging.
      */
-    yolog_level_t level;
+    volatile yolog_level_t level;
 
     struct yolog_context_group *parent;
 
@@ -262,6 +484,28 @@ typedef struct yolog_context {
      * If this subsystem logs to its own file, then it is set here
      */
     struct yolog_output_st *o_alt;
+
+    /**
+     * Bitmask of (1 << YOLOG_OUTPUT_*) outputs which accept each level,
+     * indexed by level. Rebuilt by sync_levels along with 'level'.
+     */
+    unsigned char omasks[YOLOG_LEVEL_MAX];
+
+    /**
+     * Pre-rendered headers for each output and level, for the levels the
+     * output accepts. Rebuilt by sync_levels.
+     */
+    struct yolog_hdrseg_st *headers[YOLOG_OUTPUT_COUNT][YOLOG_LEVEL_MAX];
+
+    /**
+     * Messages below this level are discarded regardless of the outputs,
+     * while the asynchronous writer is shedding load. 'level' is raised
+     * to match. See yolog_async_set_shedding()
+     */
+    volatile yolog_level_t shed;
+
+    /* messages queued since the writer last looked, while shedding load */
+    volatile unsigned long nqueued;
 } yolog_context;
 
 
@@ -324,12 +568,27 @@ yolog_init_defaults(yolog_context_group *grp,
  *
  * %(epoch) - time(NULL) result
  *
+ * %(time) - The local time in ISO-8601 format with milliseconds, e.g.
+ *  2012-03-04T05:06:07.890. The precision may be given as %(time:s),
+ *  %(time:ms), %(time:us) or %(time:ns). The date part is only recomputed
+ *  once a second by each thread.
+ *
+ * %(mono) - Seconds on the monotonic clock, with microseconds by default.
+ *  This takes the same precision suffixes as %(time).
+ *
  * %(pid) - The process ID
  *
  * %(tid) - The thread ID. On Linux this is gettid(), on other POSIX systems
  *  this does a byte-for-byte representation of the returned pthread_t from
  *  pthread_self(). On non-POSIX systems this does nothing.
  *
+ * %(tname) - The thread name, as set by pthread_setname_np() (Linux only),
+ *  or the thread ID if there is none. The name is read when the thread
+ *  first logs a message with this specifier and is not refreshed afterwards.
+ *
+ * The PID, thread ID and thread name are cached, and are reset in the child
+ * after fork().
+ *
  * %(level) - A level string, e.g. 'DEBUG', 'ERROR'
  *
  * %(filename) - The source file
@@ -338,6 +597,10 @@ yolog_init_defaults(yolog_context_group *grp,
  *
  * %(func) - The function from which the function was invoked
  *
+ * %(seq) - The order in which the message was logged, counting from 1
+ *  across all threads and groups. Messages written asynchronously (e.g. at
+ *  the priority level) may be written out of order; this restores it.
+ *
  * %(color) - This is a special specifier and indicates that normal
  *  severity color coding should begin here.
  *
@@ -377,6 +640,95 @@ void
 yolog_set_screen_format(yolog_context_group *grp,
                         const char *format);
 
+/**
+ * The context used for messages logged with a NULL context. This is exposed
+ * so that macros can check its level inline.
+ */
+YOLOG_API
+extern yolog_context yolog_global_context;
+
+/**
+ * Branch prediction hint for the inline level checks
+ */
+#ifdef __GNUC__
+#define YOLOG_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define YOLOG_UNLIKELY(x) (x)
+#endif
+
+/**
+ * Whether a message of this level may be logged by the context. If this is
+ * false, calling the logging functions is a no-op.
+ */
+#define YOLOG_CAN_LOG(ctx, lvl) \
+    YOLOG_UNLIKELY((lvl) >= (ctx)->level)
+
+/**
+ * State kept at each call site of the _ratelimited and _sampled macros
+ */
+struct yolog_limit_st {
+    /* for rate limiting: when (in ms) the call site's bucket is full again */
+    volatile unsigned long next;
+
+    /* messages held back since the last one which was logged */
+    volatile unsigned long suppressed;
+};
+
+/**
+ * Limits for the generated _ratelimited macros, which let up to 'burst'
+ * messages through at once, and 'per sec' on average. These are read at
+ * each call site, so may be defined differently for each file.
+ */
+#ifndef YOLOG_RATELIMIT_PER_SEC
+#define YOLOG_RATELIMIT_PER_SEC 10
+#endif
+
+#ifndef YOLOG_RATELIMIT_BURST
+#define YOLOG_RATELIMIT_BURST 10
+#endif
+
+/* the generated _sampled macros log one in this many messages */
+#ifndef YOLOG_SAMPLE_ONE_IN
+#define YOLOG_SAMPLE_ONE_IN 100
+#endif
+
+/**
+ * Whether a rate limited call site may log its message now. If it may, and
+ * messages were held back since the last one, their number is logged first.
+ * This doesn't lock.
+ *
+ * @param ctx the context, as for yolog_logger
+ * @param lim the call site's state, initially zeroed
+ * @param level, file, line, fn as for yolog_logger
+ * @param per_sec the average rate allowed, 0 for no limit
+ * @param burst how many messages may be logged at once
+ *
+ * @return 1 if the message may be logged, 0 if it should be dropped
+ */
+YOLOG_API
+int
+yolog_ratelimit(yolog_context *ctx,
+                struct yolog_limit_st *lim,
+                int level,
+                const char *file,
+                int line,
+                const char *fn,
+                unsigned per_sec,
+                unsigned burst);
+
+/**
+ * Like yolog_ratelimit, but picks one message in 'one_in' at random
+ */
+YOLOG_API
+int
+yolog_sample(yolog_context *ctx,
+             struct yolog_limit_st *lim,
+             int level,
+             const char *file,
+             int line,
+             const char *fn,
+             unsigned one_in);
+
 /**
  * Yolog maintains a global object for messages which have no context.
  * This function gets this object.
@@ -385,6 +737,33 @@ YOLOG_API
 yolog_context *
 yolog_get_global(void);
 
+enum {
+    /* clock_gettime(), when the message is logged */
+    YOLOG_CLOCK_DEFAULT = 0,
+
+    /**
+     * The CPU's time stamp counter, read when the message is logged and
+     * converted when it is written. x86-64 only, with an invariant TSC.
+     */
+    YOLOG_CLOCK_TSC
+};
+
+/* how often (ms) the TSC clock is calibrated against the system clocks */
+#define YOLOG_TSC_RECALIBRATE_MS 1000
+
+/**
+ * Selects where message timestamps come from. Enabling the TSC clock takes
+ * a few milliseconds to calibrate it; this should be called before there
+ * are other threads logging.
+ *
+ * @param clock one of YOLOG_CLOCK_*
+ *
+ * @return 0 on success, -1 if the clock isn't available here
+ */
+YOLOG_API
+int
+yolog_set_clock(int clock);
+
 /**
  * This will read a file and apply debug settings from there..
  *
@@ -408,17 +787,176 @@ void
 yolog_parse_envstr(yolog_context_group *grp,
                 const char *envstr);
 
+/* default number of slots in the asynchronous queue */
+#define YOLOG_ASYNC_QUEUE_DEFAULT 4096
+
+/* maximum size of a message body in asynchronous mode */
+#define YOLOG_ASYNC_MSG_MAX 1024
+
+/* number of slots in the asynchronous priority queue */
+#define YOLOG_ASYNC_PRIO_QUEUE 256
+
+/* default for how far priority messages may be written ahead of others */
+#define YOLOG_ASYNC_PRIO_WINDOW 1024
+
+/* largest window for ordered asynchronous output */
+#define YOLOG_ASYNC_ORDER_MAX 4096
+
+/* limits on the number of per-CPU shards, and on the slots in each */
+#define YOLOG_ASYNC_SHARDS_MAX 256
+#define YOLOG_ASYNC_SHARD_MIN 64
+
+/**
+ * Switch a context group to asynchronous logging.
+ *
+ * Logging threads will format their message into a slot of a lock-free
+ * queue and return; a dedicated writer thread drains the queue and writes
+ * to the group's outputs. Messages which don't fit in YOLOG_ASYNC_MSG_MAX
+ * bytes are truncated.
+ *
+ * The queue is drained and the writer stopped at exit. A process forked
+ * afterwards logs synchronously; it may call this again to have a writer of
+ * its own.
+ *
+ * @param grp the group, or NULL for the global group
+ * @param nslots number of queue slots (rounded up to a power of two), or 0
+ *  for YOLOG_ASYNC_QUEUE_DEFAULT
+ *
+ * @return 0 on success (or if it was started already, with the same
+ * settings), -1 if asynchronous mode could not be started (or is not
+ * supported on this platform), or if it was started with other settings;
+ * those only change after yolog_async_stop()
+ */
+YOLOG_API
+int
+yolog_async_start(yolog_context_group *grp, unsigned nslots);
+
+/* what a logging thread does when the asynchronous queue is full */
+enum {
+    /* wait for room, for at most the timeout if one is given */
+    YOLOG_OVERFLOW_BLOCK = 0,
+
+    /* drop the message being logged */
+    YOLOG_OVERFLOW_DROP_NEWEST,
+
+    /* drop the oldest queued message to make room */
+    YOLOG_OVERFLOW_DROP_OLDEST,
+
+    /* drop messages below the given level, and wait as for BLOCK otherwise */
+    YOLOG_OVERFLOW_DROP_BELOW
+};
+
+/**
+ * Set what happens when the asynchronous queue of a group is full. Dropped
+ * messages are counted, and the count is logged (at YOLOG_WARN, to the
+ * outputs the messages would have gone to) once the queue has room again.
+ *
+ * @param grp the group, or NULL for the global group
+ * @param policy one of YOLOG_OVERFLOW_*
+ * @param timeout_ms for BLOCK and DROP_BELOW, how long to wait before
+ *  dropping the message. 0 waits as long as it takes.
+ * @param level for DROP_BELOW, the lowest level which is not dropped
+ *
+ * @return 0 on success, -1 if the group isn't in asynchronous mode
+ */
+YOLOG_API
+int
+yolog_async_set_overflow(yolog_context_group *grp,
+                         int policy,
+                         unsigned timeout_ms,
+                         int level);
+
+/**
+ * Set which messages go through the priority queue of a group. These are
+ * written before any queued message below the level, so that they are not
+ * held up (or dropped) when the queue is congested. By default, these are
+ * messages at YOLOG_ERROR and above.
+ *
+ * @param grp the group, or NULL for the global group
+ * @param level the lowest level which is given priority, or YOLOG_LEVEL_MAX
+ *  to queue all messages in order
+ * @param window how many messages a priority message may overtake, by the
+ *  numbers printed by %(seq). 0 keeps messages in order.
+ *
+ * @return 0 on success, -1 if the group isn't in asynchronous mode
+ */
+YOLOG_API
+int
+yolog_async_set_priority(yolog_context_group *grp,
+                         int level,
+                         unsigned long window);
+
+/**
+ * Let the writer of a group shed load when it falls behind. Every so often
+ * the writer checks how full the queue is and how long messages have been
+ * waiting in it. If either is over its limit, the context which logged the
+ * most messages in the meantime has its minimum level raised by one (up to
+ * YOLOG_ERROR, or the priority level if lower). Once the queue is nearly
+ * empty again, shed contexts are lowered by one level at a time until they
+ * are back where they were. Each of these changes is logged as a warning.
+ *
+ * @param grp the group, or NULL for the global group
+ * @param depth_pct how full (in percent) the queue may get, 0 for no limit
+ * @param lag_ms how long messages may wait in the queue, 0 for no limit.
+ *  Load is not shed if both are 0, which is the default.
+ *
+ * @return 0 on success, -1 if the group isn't in asynchronous mode
+ */
+YOLOG_API
+int
+yolog_async_set_shedding(yolog_context_group *grp,
+                         unsigned depth_pct,
+                         unsigned lag_ms);
+
+/**
+ * Have the writer of a group write messages in the order they were logged
+ * (by their %(seq) number), even when they were queued out of order or to
+ * different shards or queues. The writer holds up to 'window' messages back
+ * and writes the oldest of them once it holds that many, or once there is
+ * nothing more in the queue. A message which takes longer than that to
+ * arrive is still written, out of order.
+ *
+ * This takes precedence over the priority window: priority messages still
+ * go through their own queue, but are not written ahead of their turn.
+ *
+ * @param grp the group, or NULL for the global group
+ * @param window how many messages may be held back (at most
+ *  YOLOG_ASYNC_ORDER_MAX), 0 to write them as they come (the default)
+ *
+ * @return 0 on success, -1 if the group isn't in asynchronous mode
+ */
+YOLOG_API
+int
+yolog_async_set_ordering(yolog_context_group *grp, unsigned window);
+
+/**
+ * Drain the queue and stop the writer thread, returning the group to
+ * synchronous logging. This must not be called while other threads are
+ * logging to the group.
+ */
+YOLOG_API
+void
+yolog_async_stop(yolog_context_group *grp);
+
 /**
  * These functions are mainly private
  */
 
+/* thread-local storage class, for per-thread buffers and caches */
+#ifndef YOLOG_TLS
+#ifdef __GNUC__
+#define YOLOG_TLS __thread
+#endif
+#endif /* YOLOG_TLS */
+
 /**
  * This is a hack for C89 compilers which don't support variadic macros.
- * In this case we maintain a global context which is initialized and locked.
+ * In this case the call site is kept in an implicit structure, which is
+ * per-thread if YOLOG_TLS is available, and a locked global one otherwise.
  *
- * This function tries to lock the context (it checks to see if this level can
- * be logged, locks the global structure, and returns true. If the level
- * cannot be logged, false is retured).
+ * This function checks to see if this level can be logged; if so it fills
+ * in the implicit structure (locking it if it is global), and returns true.
+ * If the level cannot be logged, false is returned.
  *
  * The functions implicit_logger() and implicit_end() should only be called
  * if implicit_begin() returns true.
@@ -438,21 +976,385 @@ void
 yolog_implicit_logger(const char *fmt, ...);
 
 /**
- * Unlocks the implicit structure
+ * Unlocks the implicit structure, if it is global
  */
 void
 yolog_implicit_end(void);
 
 
+/**
+ * Renders the header for a message into buf, returning the number of bytes
+ * written. The output is truncated (and not NUL-terminated) if it does not
+ * fit in nbuf bytes.
+ */
+size_t
+yolog_fmt_render(struct yolog_fmt_st *fmts,
+                 char *buf,
+                 size_t nbuf,
+                 const struct yolog_msginfo_st *minfo);
+
+/**
+ * Scans the next printf conversion in fmt.
+ *
+ * @param spec set to the beginning of the conversion (the '%')
+ * @param type set to a YOLOG_BINLOG_T_* constant
+ * @param nstars set to the number of '*' (int) arguments which precede the
+ *  conversion's own argument
+ *
+ * @return a pointer past the conversion, or NULL if there are no more
+ */
+const char *
+yolog_binlog_scan(const char *fmt,
+                  const char **spec,
+                  int *type,
+                  int *nstars);
+
+/**
+ * Sets up a file output for binary logging, writing the session header
+ */
+int
+yolog_binlog_init(struct yolog_output_st *output);
+
+/**
+ * Writes a message record (and the call site's definition, if this is the
+ * first time it is seen) to a binary output
+ */
+void
+yolog_binlog_write(struct yolog_output_st *output,
+                   yolog_context *ctx,
+                   const struct yolog_msginfo_st *minfo,
+                   const char *fmt,
+                   va_list ap);
+
+/**
+ * Pre-renders the invariant parts of a header, using the prefix, level and
+ * colors in minfo. Returns a single allocation to be released with free()
+ */
+struct yolog_hdrseg_st *
+yolog_fmt_precompile(struct yolog_fmt_st *fmts,
+                     const struct yolog_msginfo_st *minfo);
+
+/**
+ * Like fmt_render, but for a pre-rendered header
+ */
+size_t
+yolog_hdr_render(const struct yolog_hdrseg_st *segs,
+                 char *buf,
+                 size_t nbuf,
+                 const struct yolog_msginfo_st *minfo);
+
+/**
+ * Rebuilds the pre-rendered headers of a context. This is called by
+ * sync_levels
+ */
+void
+yolog_sync_headers(yolog_context *ctx);
+
+/**
+ * A vsnprintf which never allocates and does not consult the locale, used to
+ * render message bodies. It handles flags, width, precision and length
+ * modifiers for the d, i, u, o, x, X, c, s, p, f and F conversions. The e, g
+ * and a conversions are passed to snprintf one at a time, and formats using
+ * anything else (%n, wide characters, long doubles, positional arguments) are
+ * handed to vsnprintf as a whole. Returns what vsnprintf would.
+ */
+int
+yolog_vformat(char *buf, size_t nbuf, const char *fmt, va_list ap);
+
+/**
+ * Captures the current time and thread into the message info, for messages
+ * which are rendered later
+ */
+void
+yolog_msginfo_stamp(struct yolog_msginfo_st *minfo);
+
+/**
+ * Reads the TSC into minfo->m_tsc, if the TSC clock is in use.
+ * Returns 1 if it did, 0 otherwise.
+ */
+int
+yolog_tsc_stamp(struct yolog_msginfo_st *minfo);
+
+/**
+ * Converts a TSC value (0 for the current one) into wall clock or monotonic
+ * time. Returns -1 if the TSC clock is not in use.
+ */
+int
+yolog_tsc_time(unsigned long tsc, int monotonic,
+               unsigned long *sec, unsigned long *nsec);
+
+/**
+ * Fills in the times of a message stamped with yolog_tsc_stamp
+ */
+void
+yolog_tsc_resolve(struct yolog_msginfo_st *minfo);
+
+/**
+ * Returns the next message sequence number, as printed by %(seq)
+ */
+unsigned long
+yolog_next_seq(void);
+
+/**
+ * Returns an identifier for the calling thread, as printed by %(tid)
+ */
+unsigned long
+yolog_thread_id(void);
+
+/**
+ * Writes an already formatted message body to each output whose bit is set
+ * in omask. The asynchronous writer passes its batched I/O state as 'io';
+ * it is NULL when the logging thread writes the message itself, in which
+ * case each output's flush policy is applied.
+ */
+void
+yolog_emit(yolog_context *ctx,
+           unsigned omask,
+           struct yolog_msginfo_st *minfo,
+           const char *body,
+           size_t nbody,
+           struct yolog_io_st *io);
+
+/**
+ * Returns the outputs in omask which the context has and which take rendered
+ * messages from any thread, i.e. leaving out binary and per-thread outputs.
+ * For messages which don't come through yolog_vlogger.
+ */
+unsigned
+yolog_text_omask(yolog_context *ctx, unsigned omask);
+
+/**
+ * Writes a message to the context's output at index 'oix'
+ * (YOLOG_OUTPUT_*), as yolog_emit does once it has decided to write it
+ */
 void
-yolog_fmt_write(struct yolog_fmt_st *fmts,
-                FILE *fp,
-                const struct yolog_msginfo_st *minfo);
+yolog_emit_output(yolog_context *ctx,
+                  int oix,
+                  struct yolog_msginfo_st *minfo,
+                  const char *body,
+                  size_t nbody,
+                  struct yolog_io_st *io);
+
+/**
+ * Flushes all the outputs of a group
+ */
+void
+yolog_flush_outputs(yolog_context_group *grp);
+
+/**
+ * Applies the output's flush policy after a message of this level has been
+ * written to it. Must be called with the output locked.
+ */
+void
+yolog_output_written(struct yolog_output_st *out, int level);
+
+/**
+ * Registers an output with a flush_interval with the background flusher,
+ * which flushes it when it has been dirty for that long.
+ */
+int
+yolog_flusher_add(struct yolog_output_st *out);
+
+/**
+ * Sets up group commit for a file output. Messages at or above 'level' are
+ * made durable by a background thread calling fdatasync(), one call covering
+ * every such message written since the previous one. If 'wait' is set, the
+ * logging thread blocks until its message is durable.
+ */
+int
+yolog_durable_init(struct yolog_output_st *out, int level, int wait);
+
+/**
+ * Called with the output locked after a message has been written to it.
+ * Returns the sequence number to pass to durable_wait, or 0 if the message
+ * doesn't need to be made durable.
+ */
+unsigned long
+yolog_durable_mark(struct yolog_output_st *out, int level);
+
+/**
+ * Waits (without the output locked) until the message is durable, if the
+ * output is configured to do so
+ */
+void
+yolog_durable_wait(struct yolog_output_st *out, unsigned long seq);
+
+/**
+ * Sets up rotation for a file output. The file is rotated by a background
+ * thread once 'max_size' bytes have been written to it, or once it is
+ * 'every' seconds old (either may be 0). Up to 'keep' old segments are
+ * kept as path.1 .. path.N, and gzipped if 'compress' is set.
+ */
+int
+yolog_rotate_init(struct yolog_output_st *out,
+                  unsigned long max_size,
+                  unsigned long every,
+                  int keep,
+                  int compress);
+
+/**
+ * Called after 'nbytes' have been written to a rotating output
+ */
+void
+yolog_rotate_account(struct yolog_output_st *out, size_t nbytes);
+
+/**
+ * Switches a file output to YOLOG_OUTPUT_F_MAPPED, growing the file in
+ * extents of 'extent' bytes (0 for the default)
+ */
+int
+yolog_mapped_init(struct yolog_output_st *out, size_t extent);
+
+/**
+ * Copies a line (in up to three pieces) into a mapped output. No lock need
+ * be held.
+ */
+void
+yolog_mapped_write(struct yolog_output_st *out,
+                   const char *line, size_t nline,
+                   const char *body, size_t nbody,
+                   const char *tail, size_t ntail);
+
+/**
+ * Truncates a mapped output's file, and continues in the file open for
+ * reading and writing on 'fd' (which is dup2()'d over the old one), starting
+ * with 'mark'.
+ */
+void
+yolog_mapped_swap(struct yolog_output_st *out, int fd,
+                  const char *mark, size_t nmark);
+
+/**
+ * Makes an output collapse repeats of the same message, reporting them
+ * once a different message is written or after 'timeout' ms (0 for the
+ * default)
+ */
+int
+yolog_dedup_init(struct yolog_output_st *out, unsigned long timeout);
+
+/**
+ * Called for each message to a deduplicating output, before it is written.
+ * Returns 1 if it repeats the last message, and was only counted. Otherwise
+ * any pending repeats are reported (through 'io', as for yolog_emit) and
+ * the message becomes the one compared against.
+ */
+int
+yolog_dedup_check(struct yolog_output_st *out,
+                  yolog_context *ctx,
+                  int oix,
+                  const struct yolog_msginfo_st *minfo,
+                  const char *body,
+                  size_t nbody,
+                  struct yolog_io_st *io);
+
+/**
+ * Called by the asynchronous writer of 'grp': reports the repeats of the
+ * group's outputs which timed out, through 'io'. Returns 1 if it wrote
+ * anything.
+ */
+int
+yolog_dedup_report_due(yolog_context_group *grp, struct yolog_io_st *io);
+
+/**
+ * Switches a file output to YOLOG_OUTPUT_F_PERTHREAD
+ */
+int
+yolog_perthread_init(struct yolog_output_st *out);
+
+/**
+ * Writes a line (the header and possibly the body, then the body if 'body'
+ * is not NULL, followed by the color reset and a newline) to the calling
+ * thread's file, opening it if needed. No lock is taken. If the file can't
+ * be opened, the line goes to the shared file instead.
+ */
+void
+yolog_perthread_write(struct yolog_output_st *out,
+                      const struct yolog_msginfo_st *minfo,
+                      const char *line, size_t nline,
+                      const char *body, size_t nbody);
+
+/**
+ * Creates the batched I/O state for an asynchronous writer, using the named
+ * backend ("uring", "write" or "stdio"), or the best available if NULL
+ */
+struct yolog_io_st *
+yolog_io_create(const char *name);
+
+/**
+ * Writes out (or starts writing out) everything batched so far
+ */
+void
+yolog_io_flush(struct yolog_io_st *io);
+
+/**
+ * Writes out everything batched and waits for it to complete
+ */
+void
+yolog_io_destroy(struct yolog_io_st *io);
+
+/**
+ * Returns the batch for an output, or NULL if the output is not batched
+ */
+struct yolog_iobatch_st *
+yolog_io_batch(struct yolog_io_st *io, struct yolog_output_st *out);
+
+/**
+ * Appends a line (in up to three pieces) to an output's batch
+ */
+void
+yolog_io_append(struct yolog_io_st *io,
+                struct yolog_iobatch_st *batch,
+                const char *line, size_t nline,
+                const char *body, size_t nbody,
+                const char *tail, size_t ntail);
+
+/**
+ * Like yolog_async_start(), with the I/O backend named as for
+ * yolog_io_create(). If 'percpu' is set, the queue is split into one shard
+ * per CPU (of at least YOLOG_ASYNC_SHARD_MIN slots each).
+ */
+int
+yolog_async_start_backend(yolog_context_group *grp,
+                          unsigned nslots,
+                          const char *backend,
+                          int percpu);
+
+/**
+ * Writes out what is queued and stops the writer, for every asynchronous
+ * group, leaving them synchronous. Run at exit.
+ */
+void
+yolog_async_drain_all(void);
+
+/**
+ * Queue a message for the writer thread. Returns 0 if the message was
+ * queued, or -1 if it should be logged synchronously instead.
+ */
+int
+yolog_async_push(struct yolog_async_st *async,
+                 yolog_context *ctx,
+                 unsigned omask,
+                 const struct yolog_msginfo_st *minfo,
+                 const char *fmt,
+                 va_list ap);
 
 
 void
 yolog_sync_levels(yolog_context *ctx);
 
+/**
+ * Sets the level below which the context's messages are discarded, while
+ * load is being shed (0 when it isn't), and adjusts its 'level' to match
+ */
+void
+yolog_set_shed(yolog_context *ctx, int shed);
+
+/**
+ * Calls sync_levels on each context of the group
+ */
+void
+yolog_sync_group(yolog_context_group *grp);
+
 /**
  * These are the convenience macros. They are disabled by default because I've
  * made some effort to make yolog more embed-friendly and not clobber a project
@@ -475,55 +1377,61 @@ yolog_sync_levels(yolog_context *ctx);
  */
 
 #define yolog_debug(...) \
+(YOLOG_CAN_LOG(&yolog_global_context, YOLOG_DEBUG) ? \
 yolog_logger(\
-    NULL\
+    NULL, \
     YOLOG_DEBUG, \
     __FILE__, \
     __LINE__, \
     __func__, \
-    ## __VA_ARGS__)
+    ## __VA_ARGS__) : (void)0)
 
 #define yolog_info(...) \
+(YOLOG_CAN_LOG(&yolog_global_context, YOLOG_INFO) ? \
 yolog_logger(\
-    NULL\
+    NULL, \
     YOLOG_INFO, \
     __FILE__, \
     __LINE__, \
     __func__, \
-    ## __VA_ARGS__)
+    ## __VA_ARGS__) : (void)0)
 
 #define yolog_warn(...) \
+(YOLOG_CAN_LOG(&yolog_global_context, YOLOG_WARN) ? \
 yolog_logger(\
-    NULL\
+    NULL, \
     YOLOG_WARN, \
     __FILE__, \
     __LINE__, \
     __func__, \
-    ## __VA_ARGS__)
+    ## __VA_ARGS__) : (void)0)
 
 #define yolog_error(...) \
+(YOLOG_CAN_LOG(&yolog_global_context, YOLOG_ERROR) ? \
 yolog_logger(\
-    NULL\
+    NULL, \
     YOLOG_ERROR, \
     __FILE__, \
     __LINE__, \
     __func__, \
-    ## __VA_ARGS__)
+    ## __VA_ARGS__) : (void)0)
 
 #define yolog_crit(...) \
+(YOLOG_CAN_LOG(&yolog_global_context, YOLOG_CRIT) ? \
 yolog_logger(\
-    NULL\
+    NULL, \
     YOLOG_CRIT, \
     __FILE__, \
     __LINE__, \
     __func__, \
-    ## __VA_ARGS__)
+    ## __VA_ARGS__) : (void)0)
 
 #else /* ifdef YOLOG_C89_MACROS */
 
 
 #define yolog_debug(args) \
-if (yolog_implicit_begin( \
+if (YOLOG_CAN_LOG(&yolog_global_context, YOLOG_DEBUG) && \
+    yolog_implicit_begin( \
     NULL, \
     YOLOG_DEBUG, \
     __FILE__, \
@@ -535,7 +1443,8 @@ if (yolog_implicit_begin( \
 }
 
 #define yolog_info(args) \
-if (yolog_implicit_begin( \
+if (YOLOG_CAN_LOG(&yolog_global_context, YOLOG_INFO) && \
+    yolog_implicit_begin( \
     NULL, \
     YOLOG_INFO, \
     __FILE__, \
@@ -547,7 +1456,8 @@ if (yolog_implicit_begin( \
 }
 
 #define yolog_warn(args) \
-if (yolog_implicit_begin( \
+if (YOLOG_CAN_LOG(&yolog_global_context, YOLOG_WARN) && \
+    yolog_implicit_begin( \
     NULL, \
     YOLOG_WARN, \
     __FILE__, \
@@ -559,7 +1469,8 @@ if (yolog_implicit_begin( \
 }
 
 #define yolog_error(args) \
-if (yolog_implicit_begin( \
+if (YOLOG_CAN_LOG(&yolog_global_context, YOLOG_ERROR) && \
+    yolog_implicit_begin( \
     NULL, \
     YOLOG_ERROR, \
     __FILE__, \
@@ -571,7 +1482,8 @@ if (yolog_implicit_begin( \
 }
 
 #define yolog_crit(args) \
-if (yolog_implicit_begin( \
+if (YOLOG_CAN_LOG(&yolog_global_context, YOLOG_CRIT) && \
+    yolog_implicit_begin( \
     NULL, \
     YOLOG_CRIT, \
     __FILE__, \
@@ -50,8 +50,18 @@ my @YOLOG_SYMS_lc = qw(
     vlogger
     init_defaults
     get_global
+    global_context
     implicit_logger
     implicit_end
+    async_start
+    async_stop
+    async_set_overflow
+    async_set_priority
+    async_set_shedding
+    async_set_ordering
+    ratelimit
+    sample
+    set_clock
 );
 
 # misc identifiers/symbols, upper-cased
@@ -79,13 +89,30 @@ struct __PACKAGE__, [
     'ctxvar' => '$',
     'proj' => '$',
     'c89' => '$',
+    # '', 'ratelimited' or 'sampled'
+    'variant' => '$',
 ];
 
 sub macro_name {
     my $self = shift;
-    return $self->proj->gen_macro_name($self->prefix, $self->level);
+    my $name = $self->proj->gen_macro_name($self->prefix, $self->level);
+    $name .= "_" . $self->variant if $self->variant;
+    return $name;
 }
 
+# Call-site checks done (after the level check) by each macro variant
+my %VariantChecks = (
+    ratelimited => <<'EOF',
+    <YOLOGNS>_ratelimit(YO__CTX__, &yl__site, YO__LEVEL__, \
+        __FILE__, __LINE__, __func__, \
+        <YOLOGNS_UC>_RATELIMIT_PER_SEC, <YOLOGNS_UC>_RATELIMIT_BURST)
+EOF
+    sampled => <<'EOF',
+    <YOLOGNS>_sample(YO__CTX__, &yl__site, YO__LEVEL__, \
+        __FILE__, __LINE__, __func__, <YOLOGNS_UC>_SAMPLE_ONE_IN)
+EOF
+);
+
 sub const_level {
     my $self = shift;
     return '<YOLOGNS_UC>_' . uc($self->level);
@@ -95,11 +122,16 @@ sub generate {
     my $self = shift;
     my $txt;
 
+    if ($self->variant) {
+        return $self->generate_limited();
+    }
+
     if ($self->c89) {
         $txt = <<'EOF';
 
 #define STUBMACRO(args) \
-if (<implicit_begin>( \
+if (<YOLOGNS_UC>_CAN_LOG(YO__CHECKCTX__, YO__LEVEL__) && \
+    <implicit_begin>( \
     YO__CTX__, \
     YO__LEVEL__, \
     __FILE__, \
@@ -114,19 +146,74 @@ EOF
     } else {
         $txt = <<'EOF';
 #define STUBMACRO(...) \
+(<YOLOGNS_UC>_CAN_LOG(YO__CHECKCTX__, YO__LEVEL__) ? \
 <logfunc>(\
     YO__CTX__,\
     YO__LEVEL__, \
     __FILE__, \
     __LINE__, \
     __func__, \
-    ## __VA_ARGS__)
+    ## __VA_ARGS__) : (void)0)
 EOF
 
     }
     return $txt;
 
 }
+
+# The rate limited and sampled variants need static state at the call site,
+# so they are statements rather than expressions
+sub generate_limited {
+    my $self = shift;
+    my $check = $VariantChecks{$self->variant};
+    my $txt;
+
+    chomp($check);
+
+    if ($self->c89) {
+        $txt = <<'EOF';
+
+#define STUBMACRO(args) \
+do { \
+    static struct <YOLOGNS>_limit_st yl__site = { 0, 0 }; \
+    if (<YOLOGNS_UC>_CAN_LOG(YO__CHECKCTX__, YO__LEVEL__) && \
+YO__CHECK__ && \
+    <implicit_begin>( \
+        YO__CTX__, \
+        YO__LEVEL__, \
+        __FILE__, \
+        __LINE__, \
+        __func__)) \
+    { \
+        <implicit_log> args; \
+        <implicit_end>(); \
+    } \
+} while (0)
+EOF
+
+    } else {
+        $txt = <<'EOF';
+#define STUBMACRO(...) \
+do { \
+    static struct <YOLOGNS>_limit_st yl__site = { 0, 0 }; \
+    if (<YOLOGNS_UC>_CAN_LOG(YO__CHECKCTX__, YO__LEVEL__) && \
+YO__CHECK__) { \
+        <logfunc>(\
+            YO__CTX__,\
+            YO__LEVEL__, \
+            __FILE__, \
+            __LINE__, \
+            __func__, \
+            ## __VA_ARGS__); \
+    } \
+} while (0)
+EOF
+    }
+
+    $txt =~ s/YO__CHECK__/$check/g;
+    return $txt;
+}
+
 sub preprocess {
     my ($self,$txt) = @_;
 
@@ -134,7 +221,12 @@ sub preprocess {
     my $ctxvar = $self->ctxvar();
     my $clevel = $self->const_level();
 
+    # The level check needs a real context; NULL means the global one
+    my $checkctx = $ctxvar eq 'NULL'
+        ? '(&<YOLOGNS>_global_context)' : "($ctxvar)";
+
     $txt =~ s/STUBMACRO/$macro_name/g;
+    $txt =~ s/YO__CHECKCTX__/$checkctx/g;
     $txt =~ s/YO__CTX__/$ctxvar/g;
     $txt =~ s/YO__LEVEL__/$clevel/g;
     return $txt;
@@ -349,28 +441,36 @@ sub generate_log_macros {
     }
 
     foreach my $level (@LEVELS) {
-        my $mobj = Yolog::DebugMacro->new(prefix => $prefix,
-                                          level => $level,
-                                          ctxvar => $ctxvar,
-                                          proj => $self,
-                                          c89 => $self->c89_strict);
+        foreach my $variant ('', 'ratelimited', 'sampled') {
+            $self->generate_log_macro($prefix, $ctxvar, $level, $variant);
+        }
+    }
+}
 
-        my $ilvl = $ILevel->($level);
+sub generate_log_macro {
+    my ($self,$prefix,$ctxvar,$level,$variant) = @_;
+    my $mobj = Yolog::DebugMacro->new(prefix => $prefix,
+                                      level => $level,
+                                      ctxvar => $ctxvar,
+                                      proj => $self,
+                                      c89 => $self->c89_strict,
+                                      variant => $variant);
 
-        my $txt = <<"EOF";
+    my $ilvl = $ILevel->($level);
+
+    my $txt = <<"EOF";
 #if (defined <PROJNS_UC>_DEBUG_LEVEL \\
     && (<PROJNS_UC>_DEBUG_LEVEL > $ilvl))
 #define STUBMACRO(...)
 #else
 EOF
-        $txt .= $mobj->generate();
+    $txt .= $mobj->generate();
 
-        $txt .= "#endif /* <PROJNS_UC>_NDEBUG_LEVEL */\n";
+    $txt .= "#endif /* <PROJNS_UC>_NDEBUG_LEVEL */\n";
 
-        $txt = $mobj->preprocess($txt);
-        $txt = $self->process_template($txt);
-        $self->append_header($txt);
-    }
+    $txt = $mobj->preprocess($txt);
+    $txt = $self->process_template($txt);
+    $self->append_header($txt);
 }
 
 sub generate_ctx_offsets {
@@ -696,6 +796,15 @@ EOF
 
     $append_file->("yolog.c");
     $append_file->("format.c");
+    $append_file->("async.c");
+    $append_file->("binlog.c");
+    $append_file->("rotate.c");
+    $append_file->("mapped.c");
+    $append_file->("iobackend.c");
+    $append_file->("limit.c");
+    $append_file->("dedup.c");
+    $append_file->("perthread.c");
+    $append_file->("tsc.c");
     $append_file->("apesq/apesq.h");
     $append_file->("apesq/apesq.c");
     $append_file->("yoconf.c");
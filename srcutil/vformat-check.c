@@ -0,0 +1,115 @@
+/**
+ * vformat-check: compares yolog_vformat with the C library's vsnprintf over
+ * a table of conversions, flags, widths and precisions, including buffers
+ * too small for the result. Run by 'make check'; prints each mismatch and
+ * exits non-zero if there were any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "yolog.h"
+
+static int Failures;
+static int Count;
+
+static void
+check(size_t nbuf, const char *fmt, ...)
+{
+    char want[1024], got[1024];
+    int nwant, ngot;
+    va_list ap;
+
+    memset(want, 'X', sizeof(want));
+    memset(got, 'X', sizeof(got));
+
+    va_start(ap, fmt);
+    nwant = vsnprintf(want, nbuf, fmt, ap);
+    va_end(ap);
+
+    va_start(ap, fmt);
+    ngot = yolog_vformat(got, nbuf, fmt, ap);
+    va_end(ap);
+
+    Count++;
+    if (nwant != ngot || memcmp(want, got, nbuf) != 0) {
+        Failures++;
+        fprintf(stderr, "MISMATCH (nbuf=%lu) '%s': want %d [%.*s], got %d [%.*s]\n",
+                (unsigned long)nbuf, fmt, nwant,
+                (int)(nbuf ? nbuf - 1 : 0), want,
+                ngot, (int)(nbuf ? nbuf - 1 : 0), got);
+    }
+}
+
+static const char *Int_Formats[] = {
+    "%d", "%i", "%u", "%o", "%x", "%X", "%5d", "%-5d|", "%05d", "%+d",
+    "% d", "%.3d", "%8.3d", "%-8.3x|", "%#o", "%#x", "%#X", "%.0d", "%#.0o",
+    "[%200d]", NULL
+};
+
+static const char *Long_Formats[] = {
+    "%ld", "%lu", "%lx", "%20ld", "%-20lu|", "%020lx", "%+ld", NULL
+};
+
+static const char *Double_Formats[] = {
+    "%f", "%F", "%.0f", "%#.0f", "%.3f", "%10.2f", "%-10.2f|", "%010.2f",
+    "%+f", "% f", "%e", "%E", "%.3e", "%g", "%G", "%.10g", "%#g", "%a",
+    "[%200e]", "[%-200g]", "%.20f", "%.40f", NULL
+};
+
+static const char *Str_Formats[] = {
+    "%s", "%10s", "%-10s|", "%.2s", "%10.2s", "[%300s]", NULL
+};
+
+static const double Doubles[] = {
+    0.0, -0.0, 1.0, -1.5, 0.5, 2.5, 3.14159265358979, 1e-7, 123456789.125,
+    1e15, 1e20, 1e200, -1e300, 9.9999999, 0.0009765625
+};
+
+static const long Longs[] = {
+    0, 1, -1, 42, -42, 2147483647L, -2147483647L - 1, 0x7fffffffL * 3
+};
+
+int main(void)
+{
+    static const size_t sizes[] = { 1024, 16, 5, 1, 0 };
+    size_t si, ii, jj;
+
+    for (si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++) {
+        size_t nbuf = sizes[si];
+
+        for (ii = 0; Int_Formats[ii]; ii++) {
+            for (jj = 0; jj < sizeof(Longs) / sizeof(Longs[0]); jj++) {
+                check(nbuf, Int_Formats[ii], (int)Longs[jj]);
+            }
+        }
+        for (ii = 0; Long_Formats[ii]; ii++) {
+            for (jj = 0; jj < sizeof(Longs) / sizeof(Longs[0]); jj++) {
+                check(nbuf, Long_Formats[ii], Longs[jj]);
+            }
+        }
+        for (ii = 0; Double_Formats[ii]; ii++) {
+            for (jj = 0; jj < sizeof(Doubles) / sizeof(Doubles[0]); jj++) {
+                check(nbuf, Double_Formats[ii], Doubles[jj]);
+            }
+        }
+        for (ii = 0; Str_Formats[ii]; ii++) {
+            check(nbuf, Str_Formats[ii], "hello");
+            check(nbuf, Str_Formats[ii], "");
+        }
+
+        check(nbuf, "%c%c%c", 'a', 'b', 'c');
+        check(nbuf, "%5c|%-5c|", 'x', 'y');
+        check(nbuf, "%%");
+        check(nbuf, "%p", (void *)0x1234);
+        check(nbuf, "%s=%d (%.2f) %x", "key", 7, 0.125, 255u);
+        check(nbuf, "%*d|%-*d|%.*f", 6, 12, 6, 12, 2, 1.005);
+        check(nbuf, "%f then %s", 1e200, "more");
+        check(nbuf, "%e then %s", 1e-300, "more");
+    }
+
+    printf("vformat-check: %d of %d cases differ\n", Failures, Count);
+    return Failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
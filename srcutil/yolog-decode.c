@@ -0,0 +1,384 @@
+/**
+ * yolog-decode: turns a binary Yolog output file back into text.
+ *
+ * Usage: yolog-decode [-f FORMAT] [FILE...]
+ *
+ * FORMAT is a Yolog format string used for the message header, as would be
+ * specified by 'Format' in the configuration. It defaults to
+ * YOLOG_FORMAT_DEFAULT. If no files are given, standard input is read.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "yolog.h"
+
+struct site_st {
+    char *prefix;
+    char *file;
+    char *func;
+    char *fmt;
+    char *types;
+    uint32_t line;
+};
+
+static struct site_st *Sites;
+static size_t Sites_Alloc;
+
+static struct yolog_fmt_st *Header_Format;
+
+/* format version of the current session */
+static uint32_t Session_Version;
+
+static int
+read_exact(FILE *fp, void *buf, size_t n)
+{
+    return fread(buf, 1, n, fp) == n ? 0 : -1;
+}
+
+static char *
+read_str(FILE *fp)
+{
+    uint16_t len;
+    char *ret;
+
+    if (read_exact(fp, &len, sizeof(len)) != 0) {
+        return NULL;
+    }
+    ret = malloc(len + 1);
+    if (read_exact(fp, ret, len) != 0) {
+        free(ret);
+        return NULL;
+    }
+    ret[len] = '\0';
+    return ret;
+}
+
+static void
+reset_sites(void)
+{
+    size_t ii;
+    for (ii = 0; ii < Sites_Alloc; ii++) {
+        free(Sites[ii].prefix);
+        free(Sites[ii].file);
+        free(Sites[ii].func);
+        free(Sites[ii].fmt);
+        free(Sites[ii].types);
+    }
+    memset(Sites, 0, sizeof(*Sites) * Sites_Alloc);
+}
+
+static int
+read_definition(FILE *fp)
+{
+    uint32_t id, line;
+    struct site_st *site;
+
+    if (read_exact(fp, &id, sizeof(id)) != 0 ||
+            read_exact(fp, &line, sizeof(line)) != 0) {
+        return -1;
+    }
+
+    if (id >= Sites_Alloc) {
+        size_t nalloc = Sites_Alloc ? Sites_Alloc : 64;
+        while (nalloc <= id) {
+            nalloc *= 2;
+        }
+        Sites = realloc(Sites, nalloc * sizeof(*Sites));
+        memset(Sites + Sites_Alloc, 0,
+               (nalloc - Sites_Alloc) * sizeof(*Sites));
+        Sites_Alloc = nalloc;
+    }
+
+    site = Sites + id;
+    site->line = line;
+    site->prefix = read_str(fp);
+    site->file = read_str(fp);
+    site->func = read_str(fp);
+    site->fmt = read_str(fp);
+    site->types = read_str(fp);
+
+    if (!site->types) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Re-run each conversion of the format with its argument
+ */
+static void
+print_body(const struct site_st *site, const char *payload, size_t nload)
+{
+    const char *fmt = site->fmt, *next, *spec;
+    int type, nstars;
+    size_t pos = 0;
+
+#define take(v) do { \
+    if (pos + sizeof(v) <= nload) { \
+        memcpy(&(v), payload + pos, sizeof(v)); \
+        pos += sizeof(v); \
+    } \
+} while (0)
+
+    if (*site->types == YOLOG_BINLOG_T_TEXT) {
+        uint32_t slen = 0;
+        take(slen);
+        if (pos + slen <= nload) {
+            fwrite(payload + pos, 1, slen, stdout);
+        }
+        return;
+    }
+
+    while ((next = yolog_binlog_scan(fmt, &spec, &type, &nstars))) {
+        char specbuf[64];
+        int stars[2] = { 0, 0 };
+        int ii;
+        long long ival = 0;
+        double dval = 0;
+        char *sval = NULL;
+
+        fwrite(fmt, 1, spec - fmt, stdout);
+        fmt = next;
+
+        if (type == YOLOG_BINLOG_T_NONE) {
+            putchar('%');
+            continue;
+        }
+
+        if ((size_t)(next - spec) >= sizeof(specbuf)) {
+            fwrite(spec, 1, next - spec, stdout);
+            continue;
+        }
+        memcpy(specbuf, spec, next - spec);
+        specbuf[next - spec] = '\0';
+
+        for (ii = 0; ii < nstars; ii++) {
+            take(ival);
+            stars[ii] = (int)ival;
+        }
+
+        if (type == YOLOG_BINLOG_T_DOUBLE) {
+            take(dval);
+        } else if (type == YOLOG_BINLOG_T_STRING) {
+            uint32_t slen = 0;
+            take(slen);
+            if (pos + slen > nload) {
+                slen = nload - pos;
+            }
+            sval = malloc(slen + 1);
+            memcpy(sval, payload + pos, slen);
+            sval[slen] = '\0';
+            pos += slen;
+        } else {
+            take(ival);
+        }
+
+#define emit(v) \
+        if (nstars == 0) { \
+            printf(specbuf, v); \
+        } else if (nstars == 1) { \
+            printf(specbuf, stars[0], v); \
+        } else { \
+            printf(specbuf, stars[0], stars[1], v); \
+        }
+
+        switch (type) {
+        case YOLOG_BINLOG_T_INT:
+            emit((int)ival);
+            break;
+        case YOLOG_BINLOG_T_LONG:
+            emit((long)ival);
+            break;
+        case YOLOG_BINLOG_T_LLONG:
+            emit(ival);
+            break;
+        case YOLOG_BINLOG_T_SIZE:
+            emit((size_t)ival);
+            break;
+        case YOLOG_BINLOG_T_PTRDIFF:
+            emit((ptrdiff_t)ival);
+            break;
+        case YOLOG_BINLOG_T_PTR:
+            emit((void*)(size_t)ival);
+            break;
+        case YOLOG_BINLOG_T_DOUBLE:
+            emit(dval);
+            break;
+        case YOLOG_BINLOG_T_STRING:
+            emit(sval);
+            break;
+        default:
+            break;
+        }
+#undef emit
+        free(sval);
+    }
+#undef take
+
+    fputs(fmt, stdout);
+}
+
+static int
+read_message(FILE *fp)
+{
+    uint32_t id, nsec, plen;
+    uint64_t sec, tid, seq = 0;
+    unsigned char level;
+    char *payload;
+    char hdr[YOLOG_LINE_MAX];
+    size_t nhdr;
+    struct yolog_msginfo_st minfo;
+    struct site_st *site;
+
+    if (read_exact(fp, &id, sizeof(id)) != 0 ||
+            read_exact(fp, &level, sizeof(level)) != 0 ||
+            read_exact(fp, &sec, sizeof(sec)) != 0 ||
+            read_exact(fp, &nsec, sizeof(nsec)) != 0 ||
+            read_exact(fp, &tid, sizeof(tid)) != 0 ||
+            (Session_Version >= 2 &&
+                    read_exact(fp, &seq, sizeof(seq)) != 0) ||
+            read_exact(fp, &plen, sizeof(plen)) != 0) {
+        return -1;
+    }
+
+    payload = malloc(plen + 1);
+    if (read_exact(fp, payload, plen) != 0) {
+        free(payload);
+        return -1;
+    }
+
+    if (id >= Sites_Alloc || Sites[id].types == NULL) {
+        fprintf(stderr, "yolog-decode: Message for unknown call site %u\n",
+                (unsigned)id);
+        free(payload);
+        return 0;
+    }
+    site = Sites + id;
+
+    memset(&minfo, 0, sizeof(minfo));
+    minfo.co_line = minfo.co_title = minfo.co_reset = "";
+    minfo.m_prefix = site->prefix;
+    minfo.m_file = site->file;
+    minfo.m_func = site->func;
+    minfo.m_line = site->line;
+    minfo.m_level = level;
+    minfo.m_time = sec;
+    minfo.m_nsec = nsec;
+    minfo.m_tid = tid;
+    minfo.m_seq = seq;
+
+    nhdr = yolog_fmt_render(Header_Format, hdr, sizeof(hdr), &minfo);
+    fwrite(hdr, 1, nhdr, stdout);
+    print_body(site, payload, plen);
+    putchar('\n');
+
+    free(payload);
+    return 0;
+}
+
+static int
+decode(FILE *fp, const char *name)
+{
+    int c;
+
+    while ((c = getc(fp)) != EOF) {
+        int rv = 0;
+
+        if (c == YOLOG_BINLOG_MAGIC[0]) {
+            char magic[sizeof(YOLOG_BINLOG_MAGIC)-1];
+            uint32_t version, bom;
+            magic[0] = c;
+
+            if (read_exact(fp, magic + 1, sizeof(magic)-1) != 0 ||
+                    memcmp(magic, YOLOG_BINLOG_MAGIC, sizeof(magic)) != 0 ||
+                    read_exact(fp, &version, sizeof(version)) != 0 ||
+                    read_exact(fp, &bom, sizeof(bom)) != 0) {
+                rv = -1;
+
+            } else if (version < 1 || version > YOLOG_BINLOG_VERSION ||
+                    bom != 0x01020304) {
+                fprintf(stderr, "%s: Unsupported version or byte order\n",
+                        name);
+                return -1;
+            }
+            Session_Version = version;
+
+            /* new session */
+            reset_sites();
+
+        } else if (c == '-') {
+            /* text mark line */
+            putchar(c);
+            while ((c = getc(fp)) != EOF) {
+                putchar(c);
+                if (c == '\n') {
+                    break;
+                }
+            }
+
+        } else if (c == YOLOG_BINLOG_REC_DEFINE) {
+            rv = read_definition(fp);
+
+        } else if (c == YOLOG_BINLOG_REC_MESSAGE) {
+            rv = read_message(fp);
+
+        } else {
+            rv = -1;
+        }
+
+        if (rv != 0) {
+            fprintf(stderr, "%s: Truncated or corrupt record at offset %ld\n",
+                    name, ftell(fp));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *fmtstr = YOLOG_FORMAT_DEFAULT;
+    int opt, ii, ret = 0;
+
+    while ((opt = getopt(argc, argv, "f:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            fmtstr = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-f FORMAT] [FILE...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Header_Format = yolog_fmt_compile(fmtstr);
+    if (!Header_Format) {
+        fprintf(stderr, "Bad format '%s'\n", fmtstr);
+        exit(EXIT_FAILURE);
+    }
+
+    if (optind == argc) {
+        return decode(stdin, "<stdin>") == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    for (ii = optind; ii < argc; ii++) {
+        FILE *fp = fopen(argv[ii], "rb");
+        if (!fp) {
+            perror(argv[ii]);
+            ret = EXIT_FAILURE;
+            continue;
+        }
+        if (decode(fp, argv[ii]) != 0) {
+            ret = EXIT_FAILURE;
+        }
+        fclose(fp);
+        reset_sites();
+    }
+
+    return ret;
+}
@@ -0,0 +1,255 @@
+/**
+ * yolog-merge: merges per-thread Yolog output files into a single stream.
+ *
+ * Usage: yolog-merge [-k] [-s] FILE...
+ *
+ * Each FILE is one of the path.<tid> files written by a PerThread output.
+ * Messages are written to standard output ordered by their time, then by
+ * their sequence number, then by the order of the files on the command line.
+ * With -s, the sequence number comes first; this is the exact order in which
+ * the messages were logged, but only holds for files from a single run of
+ * the program. The merge keys are stripped unless -k is given.
+ *
+ * Lines of a file which don't start with a merge key are kept with the
+ * message before them.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct source_st {
+    FILE *fp;
+    const char *name;
+    int index;
+
+    /* key of the current message */
+    unsigned long sec;
+    unsigned long nsec;
+    unsigned long seq;
+
+    /* the current message, with the key (nkey bytes) and any continuations */
+    char *msg;
+    size_t nmsg;
+    size_t amsg;
+    size_t nkey;
+
+    /* the line after the current message, if it was read already */
+    char *next;
+    size_t anext;
+    ssize_t nnext;
+};
+
+static struct source_st **Heap;
+static size_t Heap_Count;
+
+static int Keep_Keys;
+static int Seq_First;
+
+/**
+ * Parses "<seconds>.<9 digits> <seq> " at the start of a line, returning
+ * its length, or 0 if the line has no key
+ */
+static size_t
+parse_key(const char *line, size_t n,
+          unsigned long *sec, unsigned long *nsec, unsigned long *seq)
+{
+    size_t pos = 0, start;
+    int field;
+    unsigned long *vals[3];
+
+    vals[0] = sec;
+    vals[1] = nsec;
+    vals[2] = seq;
+
+    for (field = 0; field < 3; field++) {
+        *vals[field] = 0;
+        start = pos;
+        while (pos < n && line[pos] >= '0' && line[pos] <= '9') {
+            *vals[field] = *vals[field] * 10 + (line[pos++] - '0');
+        }
+
+        if (pos == start || pos == n) {
+            return 0;
+        }
+        if (field == 1 && pos - start != 9) {
+            return 0;
+        }
+        if (line[pos++] != (field == 0 ? '.' : ' ')) {
+            return 0;
+        }
+    }
+    return pos;
+}
+
+static void
+append_msg(struct source_st *src, const char *data, size_t n)
+{
+    if (src->nmsg + n > src->amsg) {
+        src->amsg = (src->nmsg + n) * 2;
+        src->msg = realloc(src->msg, src->amsg);
+        if (!src->msg) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(src->msg + src->nmsg, data, n);
+    src->nmsg += n;
+}
+
+/**
+ * Reads the next message of a source. Returns 0 at the end of the file.
+ */
+static int
+read_message(struct source_st *src)
+{
+    src->nmsg = 0;
+    src->nkey = 0;
+    src->sec = src->nsec = src->seq = 0;
+
+    if (src->nnext < 0) {
+        src->nnext = getline(&src->next, &src->anext, src->fp);
+        if (src->nnext < 0) {
+            return 0;
+        }
+    }
+
+    /* the first line; if it has no key the message sorts first */
+    src->nkey = parse_key(src->next, src->nnext,
+                          &src->sec, &src->nsec, &src->seq);
+    append_msg(src, src->next, src->nnext);
+
+    for (;;) {
+        unsigned long sec, nsec, seq;
+
+        src->nnext = getline(&src->next, &src->anext, src->fp);
+        if (src->nnext < 0) {
+            break;
+        }
+        if (parse_key(src->next, src->nnext, &sec, &nsec, &seq)) {
+            break;
+        }
+        append_msg(src, src->next, src->nnext);
+    }
+    return 1;
+}
+
+static int
+source_before(const struct source_st *a, const struct source_st *b)
+{
+    if (Seq_First && a->seq != b->seq) {
+        return a->seq < b->seq;
+    }
+    if (a->sec != b->sec) {
+        return a->sec < b->sec;
+    }
+    if (a->nsec != b->nsec) {
+        return a->nsec < b->nsec;
+    }
+    if (a->seq != b->seq) {
+        return a->seq < b->seq;
+    }
+    return a->index < b->index;
+}
+
+static void
+heap_down(size_t ii)
+{
+    for (;;) {
+        size_t child = ii * 2 + 1, min = ii;
+        struct source_st *tmp;
+
+        if (child < Heap_Count && source_before(Heap[child], Heap[min])) {
+            min = child;
+        }
+        if (child + 1 < Heap_Count &&
+                source_before(Heap[child + 1], Heap[min])) {
+            min = child + 1;
+        }
+        if (min == ii) {
+            return;
+        }
+        tmp = Heap[ii];
+        Heap[ii] = Heap[min];
+        Heap[min] = tmp;
+        ii = min;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int opt, ii, ret = 0;
+    size_t jj;
+
+    while ((opt = getopt(argc, argv, "ksh")) != -1) {
+        switch (opt) {
+        case 'k':
+            Keep_Keys = 1;
+            break;
+        case 's':
+            Seq_First = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-k] [-s] FILE...\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind == argc) {
+        fprintf(stderr, "Usage: %s [-k] [-s] FILE...\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    Heap = calloc(argc - optind, sizeof(*Heap));
+
+    for (ii = optind; ii < argc; ii++) {
+        struct source_st *src = calloc(1, sizeof(*src));
+
+        src->fp = fopen(argv[ii], "r");
+        if (!src->fp) {
+            perror(argv[ii]);
+            ret = EXIT_FAILURE;
+            free(src);
+            continue;
+        }
+        src->name = argv[ii];
+        src->index = ii;
+        src->nnext = -1;
+
+        if (read_message(src)) {
+            Heap[Heap_Count++] = src;
+        } else {
+            fclose(src->fp);
+            free(src);
+        }
+    }
+
+    for (jj = Heap_Count; jj > 0; jj--) {
+        heap_down(jj - 1);
+    }
+
+    while (Heap_Count) {
+        struct source_st *src = Heap[0];
+        size_t skip = Keep_Keys ? 0 : src->nkey;
+
+        fwrite(src->msg + skip, 1, src->nmsg - skip, stdout);
+
+        if (!read_message(src)) {
+            if (ferror(src->fp)) {
+                perror(src->name);
+                ret = EXIT_FAILURE;
+            }
+            fclose(src->fp);
+            free(src->msg);
+            free(src->next);
+            free(src);
+            Heap[0] = Heap[--Heap_Count];
+        }
+        heap_down(0);
+    }
+
+    free(Heap);
+    return ret;
+}